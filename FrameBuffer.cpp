@@ -0,0 +1,86 @@
+#include "FrameBuffer.h"
+#include <new>
+#include <string.h>
+
+FrameBuffer::FrameBuffer()
+{
+	data = NULL;
+	owned = false;
+	width = 0;
+	height = 0;
+	pitch = 0;
+	format = COLOR_RGBA8;
+}
+
+FrameBuffer::~FrameBuffer()
+{
+	Free();
+}
+
+void FrameBuffer::Free()
+{
+	if (data && owned)
+		::operator delete(data, std::align_val_t(FRAME_ALIGNMENT));
+	data = NULL;
+	owned = false;
+}
+
+void FrameBuffer::Resize(int width, int height, ColorFormat format)
+{
+	if (data && owned && width == this->width && height == this->height && format == this->format)
+		return;
+
+	Free();
+	this->width = width;
+	this->height = height;
+	this->format = format;
+	pitch = PitchOf(width, format);
+	data = (unsigned char*)::operator new(pitch * height, std::align_val_t(FRAME_ALIGNMENT));
+	owned = true;
+	clearedTiles.clear();
+	Clear();
+}
+
+void FrameBuffer::Attach(unsigned char* memory, int width, int height, ColorFormat format)
+{
+	Free();
+	this->width = width;
+	this->height = height;
+	this->format = format;
+	pitch = PitchOf(width, format);
+	data = memory;
+	clearedTiles.clear();
+}
+
+size_t FrameBuffer::PitchOf(int width, ColorFormat format)
+{
+	size_t pitchPixels = (width + FRAME_PITCH_PIXELS - 1) / FRAME_PITCH_PIXELS * FRAME_PITCH_PIXELS;
+	return pitchPixels * PixelSize(format);
+}
+
+void FrameBuffer::Clear()
+{
+	Clear(0, 0, width, height);
+}
+
+void FrameBuffer::Clear(int x0, int y0, int width, int height)
+{
+	for (int y = y0; y < y0 + height; y++)
+	{
+		unsigned char* first = Row(y) + x0 * PixelSize();
+		if (format == COLOR_RGBA8)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				first[4 * x + 0] = 0;
+				first[4 * x + 1] = 0;
+				first[4 * x + 2] = 0;
+				first[4 * x + 3] = 255;
+			}
+		}
+		else
+		{
+			memset(first, 0, width * PixelSize());
+		}
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+
+#define FRAME_ALIGNMENT 64		// Bytes every row starts on, a cache line and an AVX-512 register
+#define FRAME_PITCH_PIXELS 16	// Rows are padded to a multiple of this many pixels, which keeps them aligned in either format
+
+// Pixel formats of the frame the CPU renderer writes, row by row from the bottom
+enum ColorFormat {
+	COLOR_RGB_FLOAT,	// Three floats per pixel, for glDrawPixels(GL_RGB, GL_FLOAT)
+	COLOR_RGBA8			// Four unsigned normalized bytes per pixel, alpha 1, for glDrawPixels(GL_RGBA, GL_UNSIGNED_BYTE)
+};
+
+// Frame with runtime dimensions, either heap-allocated or placed in memory owned by someone else (such as a
+// mapped pixel buffer). Rows are pitch bytes apart and aligned to FRAME_ALIGNMENT, so any size, up to 4K and
+// 8K offline frames, works without recompiling.
+class FrameBuffer {
+private:
+	unsigned char* data;
+	bool owned;				// data was allocated by Resize
+	int width, height;
+	size_t pitch;			// Bytes from the start of one row to the next
+	ColorFormat format;
+	std::vector<char> clearedTiles;
+
+	void Free();
+
+public:
+
+	FrameBuffer();
+	~FrameBuffer();
+	FrameBuffer(const FrameBuffer&) = delete;
+	FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+	// Reallocate for a new size or format and clear to black. Does nothing when both are unchanged.
+	void Resize(int width, int height, ColorFormat format);
+
+	// Use memory of at least Bytes(width, height, format), aligned to FRAME_ALIGNMENT, without taking
+	// ownership. The pixels are left as they are.
+	void Attach(unsigned char* memory, int width, int height, ColorFormat format);
+
+	// Row pitch and total size of a frame, for memory handed to Attach
+	static size_t PitchOf(int width, ColorFormat format);
+	static size_t Bytes(int width, int height, ColorFormat format) { return PitchOf(width, format) * height; }
+
+	// Set every pixel to black (alpha 1), or only those of the width x height rectangle at (x0, y0)
+	void Clear();
+	void Clear(int x0, int y0, int width, int height);
+
+	int Width() const { return width; }
+	int Height() const { return height; }
+	size_t Pitch() const { return pitch; }
+	ColorFormat Format() const { return format; }
+	unsigned char* Data() { return data; }
+
+	// Bytes per pixel of a format
+	static size_t PixelSize(ColorFormat format) { return format == COLOR_RGBA8 ? 4 : 3 * sizeof(float); }
+	size_t PixelSize() const { return PixelSize(format); }
+
+	// First pixel of row y, counted from the bottom
+	unsigned char* Row(int y) { return data + (size_t)y * pitch; }
+
+	// Pixels from the start of one row to the next, for GL_UNPACK_ROW_LENGTH
+	int PitchPixels() const { return (int)(pitch / PixelSize()); }
+
+	// Per renderer tile: set while the frame holds only the clear color there. Emptied whenever the
+	// frame is reallocated or attached, and sized by the renderer.
+	std::vector<char>& ClearedTiles() { return clearedTiles; }
+};
@@ -0,0 +1,248 @@
+#include "FramePresenter.h"
+#include <iostream>
+
+// Internal format, and format and type of the pixels, of a frame format
+static void TextureFormat(ColorFormat format, GLint& internalFormat, GLenum& pixelFormat, GLenum& type)
+{
+	if (format == COLOR_RGBA8)
+	{
+		internalFormat = GL_RGBA8;
+		pixelFormat = GL_RGBA;
+		type = GL_UNSIGNED_BYTE;
+	}
+	else
+	{
+		internalFormat = GL_RGB32F;
+		pixelFormat = GL_RGB;
+		type = GL_FLOAT;
+	}
+}
+
+FramePresenter::FramePresenter()
+{
+	texture = 0;
+	for (int i = 0; i < PRESENT_BUFFERS; i++)
+	{
+		buffers[i] = 0;
+		fences[i] = 0;
+		mapped[i] = NULL;
+	}
+	current = 0;
+	width = 0;
+	height = 0;
+	textureWidth = 0;
+	textureHeight = 0;
+	format = COLOR_RGBA8;
+	persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+	presented = false;
+}
+
+FramePresenter::~FramePresenter()
+{
+	Release();
+}
+
+void FramePresenter::Release()
+{
+	if (!persistent)
+		return;
+
+	for (int i = 0; i < PRESENT_BUFFERS; i++)
+	{
+		if (fences[i])
+		{
+			glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(fences[i]);
+			fences[i] = 0;
+		}
+		if (buffers[i])
+		{
+			if (mapped[i])
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+			glDeleteBuffers(1, &buffers[i]);
+			buffers[i] = 0;
+			mapped[i] = NULL;
+		}
+	}
+	if (texture)
+	{
+		glDeleteTextures(1, &texture);
+		texture = 0;
+	}
+}
+
+void FramePresenter::Allocate(int width, int height, ColorFormat format)
+{
+	this->width = width;
+	this->height = height;
+	this->format = format;
+	current = 0;
+	presented = false;
+	if (!persistent)
+		return;
+
+	Release();
+
+	// Texture the frames are copied into, specified at the size of each frame as it is presented
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	textureWidth = 0;
+	textureHeight = 0;
+
+	// Buffers stay mapped for their whole life; coherent mapping makes CPU writes visible without flushes
+	size_t bytes = FrameBuffer::Bytes(width, height, format);
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(PRESENT_BUFFERS, buffers);
+	for (int i = 0; i < PRESENT_BUFFERS; i++)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, flags);
+		mapped[i] = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, flags);
+		frames[i].Attach(mapped[i], width, height, format);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	// Without all of the mappings, frames are heap-allocated and drawn with glDrawPixels from now on
+	for (int i = 0; i < PRESENT_BUFFERS; i++)
+	{
+		if (!mapped[i])
+		{
+			std::cerr << "Could not map the pixel buffers, falling back to glDrawPixels" << std::endl;
+			Release();
+			persistent = false;
+			return;
+		}
+	}
+}
+
+FrameBuffer& FramePresenter::Acquire(int width, int height, ColorFormat format)
+{
+	// Buffers are only reallocated to grow or change format; smaller frames, such as those of dynamic
+	// resolution, use the start of them
+	if (width > this->width || height > this->height || format != this->format)
+		Allocate(width, height, format);
+
+	if (!persistent)
+	{
+		frames[current].Resize(width, height, format);
+		return frames[current];
+	}
+
+	// The GPU may still be copying out of this buffer from PRESENT_BUFFERS frames ago
+	if (fences[current])
+	{
+		glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		glDeleteSync(fences[current]);
+		fences[current] = 0;
+	}
+
+	// A frame smaller than the buffer is laid out with its own pitch from the start of it
+	FrameBuffer& frame = frames[current];
+	if (frame.Width() != width || frame.Height() != height)
+		frame.Attach(mapped[current], width, height, format);
+	return frame;
+}
+
+void FramePresenter::Present(int viewportWidth, int viewportHeight)
+{
+	if (!persistent)
+	{
+		DrawPixels(viewportWidth, viewportHeight);
+		presented = true;
+		return;
+	}
+
+	// The texture has the frame's size, so that filtering while scaling never reaches past its edges
+	FrameBuffer& frame = frames[current];
+	GLint internalFormat;
+	GLenum pixelFormat, type;
+	TextureFormat(format, internalFormat, pixelFormat, type);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	if (frame.Width() != textureWidth || frame.Height() != textureHeight)
+	{
+		textureWidth = frame.Width();
+		textureHeight = frame.Height();
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, textureWidth, textureHeight, 0, pixelFormat, type, NULL);
+	}
+
+	// The copy into the texture reads the buffer on the GPU timeline; the fence marks when it is done
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.PitchPixels());
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[current]);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, textureWidth, textureHeight, pixelFormat, type, NULL);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	DrawTexture(viewportWidth, viewportHeight);
+	presented = true;
+	current = (current + 1) % PRESENT_BUFFERS;
+}
+
+bool FramePresenter::Redraw(int viewportWidth, int viewportHeight)
+{
+	if (!presented)
+		return false;
+
+	// The texture still holds the last frame; without persistent buffers, the only frame does
+	if (persistent)
+		DrawTexture(viewportWidth, viewportHeight);
+	else
+		DrawPixels(viewportWidth, viewportHeight);
+	return true;
+}
+
+void FramePresenter::DrawPixels(int viewportWidth, int viewportHeight)
+{
+	// From the bottom left corner of the viewport, zoomed to fill it
+	FrameBuffer& frame = frames[current];
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glRasterPos2f(-1.0f, -1.0f);
+	glPixelZoom((float)viewportWidth / frame.Width(), (float)viewportHeight / frame.Height());
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.PitchPixels());
+	if (format == COLOR_RGBA8)
+		glDrawPixels(frame.Width(), frame.Height(), GL_RGBA, GL_UNSIGNED_BYTE, frame.Data());
+	else
+		glDrawPixels(frame.Width(), frame.Height(), GL_RGB, GL_FLOAT, frame.Data());
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelZoom(1.0f, 1.0f);
+}
+
+void FramePresenter::DrawTexture(int viewportWidth, int viewportHeight)
+{
+	// Fullscreen quad in clip space, without depth test or culling. Texels map to pixels 1:1 unless the
+	// frame was rendered at a lower resolution, which is then filtered up.
+	GLint filter = textureWidth == viewportWidth && textureHeight == viewportHeight ? GL_NEAREST : GL_LINEAR;
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glPushAttrib(GL_ENABLE_BIT);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	glBegin(GL_QUADS);
+		glTexCoord2f(0.0f, 0.0f);
+		glVertex2f(-1.0f, -1.0f);
+		glTexCoord2f(1.0f, 0.0f);
+		glVertex2f(1.0f, -1.0f);
+		glTexCoord2f(1.0f, 1.0f);
+		glVertex2f(1.0f, 1.0f);
+		glTexCoord2f(0.0f, 1.0f);
+		glVertex2f(-1.0f, 1.0f);
+	glEnd();
+	glPopAttrib();
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
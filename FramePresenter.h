@@ -0,0 +1,53 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include "FrameBuffer.h"
+
+
+#define PRESENT_BUFFERS 3		// Frames in flight: one being rendered while the GPU still reads the others
+
+// Shows CPU frames in the window. With persistently mapped buffers (GL 4.4 or ARB_buffer_storage), frames
+// are rendered straight into a ring of pixel buffer objects and copied by the GPU into a texture drawn as a
+// fullscreen quad, so the CPU never waits on the upload. Without them, or when they cannot be mapped, frames
+// are heap-allocated and drawn with glDrawPixels.
+class FramePresenter {
+private:
+	GLuint texture;
+	GLuint buffers[PRESENT_BUFFERS];
+	GLsync fences[PRESENT_BUFFERS];		// Signaled once the GPU has read each buffer
+	unsigned char* mapped[PRESENT_BUFFERS];
+	FrameBuffer frames[PRESENT_BUFFERS];	// Views of the mapped buffers, or owned memory
+	int current;						// Frame handed out by Acquire
+	int width, height;					// Largest frame the buffers hold
+	ColorFormat format;
+	int textureWidth, textureHeight;
+	bool persistent;
+	bool presented;						// A frame has been presented since the buffers were allocated
+
+	void Allocate(int width, int height, ColorFormat format);
+	void Release();
+	void DrawTexture(int viewportWidth, int viewportHeight);
+	void DrawPixels(int viewportWidth, int viewportHeight);
+
+public:
+
+	// Needs a current OpenGL context
+	FramePresenter();
+	~FramePresenter();
+	FramePresenter(const FramePresenter&) = delete;
+	FramePresenter& operator=(const FramePresenter&) = delete;
+
+	// Frame to render the next image into, waiting until the GPU has finished reading it
+	FrameBuffer& Acquire(int width, int height, ColorFormat format);
+
+	// Show the frame returned by Acquire over the whole viewport, scaled up when it is smaller
+	void Present(int viewportWidth, int viewportHeight);
+
+	// Show the last presented frame again, without rendering or uploading anything. Returns false when
+	// there is none.
+	bool Redraw(int viewportWidth, int viewportHeight);
+
+	// Whether frames go through persistently mapped pixel buffers
+	bool Persistent() const { return persistent; }
+};
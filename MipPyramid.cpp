@@ -0,0 +1,61 @@
+#include "MipPyramid.h"
+#include "ThreadPool.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define MIP_SSE
+#include <xmmintrin.h>
+#endif
+
+// Reduce row y of a level width texels wide from rows 2y and 2y + 1 of the level before it. Each texel is the
+// average of a 2x2 block; an odd last column or row of the source is dropped.
+static void reduceRow(const float* source, int sourceWidth, float* destination, int width, int y)
+{
+	const float* a = source + 3 * (size_t)sourceWidth * (2 * y);
+	const float* b = a + 3 * (size_t)sourceWidth;
+	float* out = destination + 3 * (size_t)width * y;
+	int x = 0;
+#ifdef MIP_SSE
+	// Four texels at a time. Each is summed in a vector of its three channels and a spare lane, and the four
+	// are packed into three full vectors for the store. The last texel of the row is left to the scalar loop,
+	// so that no load reaches past the two source rows, which may end where another thread writes.
+	const __m128 quarter = _mm_set1_ps(0.25f);
+	for (; x + 4 < width; x += 4)
+	{
+		__m128 sum[4];
+		for (int i = 0; i < 4; i++)
+		{
+			const float* a0 = a + 6 * (x + i);
+			const float* b0 = b + 6 * (x + i);
+			sum[i] = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(a0), _mm_loadu_ps(a0 + 3)), _mm_add_ps(_mm_loadu_ps(b0), _mm_loadu_ps(b0 + 3)));
+		}
+		__m128 blue0Red1 = _mm_shuffle_ps(sum[0], sum[1], _MM_SHUFFLE(0, 0, 2, 2));
+		__m128 blue2Red3 = _mm_shuffle_ps(sum[2], sum[3], _MM_SHUFFLE(0, 0, 2, 2));
+		float* out0 = out + 3 * x;
+		_mm_storeu_ps(out0, _mm_mul_ps(_mm_shuffle_ps(sum[0], blue0Red1, _MM_SHUFFLE(2, 0, 1, 0)), quarter));
+		_mm_storeu_ps(out0 + 4, _mm_mul_ps(_mm_shuffle_ps(sum[1], sum[2], _MM_SHUFFLE(1, 0, 2, 1)), quarter));
+		_mm_storeu_ps(out0 + 8, _mm_mul_ps(_mm_shuffle_ps(blue2Red3, sum[3], _MM_SHUFFLE(2, 1, 2, 0)), quarter));
+	}
+#endif
+	for (; x < width; x++)
+		for (int c = 0; c < 3; c++)
+			out[3 * x + c] = 0.25f * ((a[6 * x + c] + a[6 * x + 3 + c]) + (b[6 * x + c] + b[6 * x + 3 + c]));
+}
+
+void MipPyramid::Generate(ThreadPool& pool)
+{
+	// Each level from the one before it, so every level reads a quarter of what the previous one did
+	for (int i = 1; i < levels; i++)
+	{
+		const float* source = Level(i - 1);
+		float* destination = Level(i);
+		int sourceWidth = width[i - 1];
+		int levelWidth = width[i];
+		int levelHeight = height[i];
+		int bands = (levelHeight + MIP_BAND_ROWS - 1) / MIP_BAND_ROWS;
+		pool.ParallelFor(bands, [&](int band, int) {
+			int last = std::min(levelHeight, (band + 1) * MIP_BAND_ROWS);
+			for (int y = band * MIP_BAND_ROWS; y < last; y++)
+				reduceRow(source, sourceWidth, destination, levelWidth, y);
+		});
+	}
+}
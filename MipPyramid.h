@@ -0,0 +1,54 @@
+#pragma once
+
+#include <limits.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+class ThreadPool;
+
+
+#define MAX_MIP_LEVELS 32
+#define MIP_BAND_ROWS 16		// Rows of a level each thread pool job reduces
+#define MAX_MIP_FLOATS INT_MAX	// Largest pyramid; the SIMD spans gather texels with 32-bit indices
+
+// Mip pyramid of an RGB float texture. Each level is half the size of the one before, down to a single texel
+// on the shorter side, and the levels are stored one after another in a single allocation.
+struct MipPyramid {
+	std::vector<float> texels;
+	int levels = 0;
+	int width[MAX_MIP_LEVELS], height[MAX_MIP_LEVELS];
+	size_t offset[MAX_MIP_LEVELS];							// First float of each level
+	float scaleX[MAX_MIP_LEVELS], scaleY[MAX_MIP_LEVELS];	// Texels of each level per level 0 texel
+
+	// Lay out and allocate the levels of a width0 x height0 texture. Returns false, leaving the pyramid empty,
+	// when it would take more than MAX_MIP_FLOATS floats.
+	bool Allocate(int width0, int height0) {
+		int count = 1 + (int)log2((double)std::min(width0, height0));
+		size_t size = 0;
+		for (int i = 0; i < count; i++) {
+			width[i] = width0 >> i;
+			height[i] = height0 >> i;
+			offset[i] = size;
+			scaleX[i] = (float)width[i] / width0;
+			scaleY[i] = (float)height[i] / height0;
+			size += 3 * (size_t)width[i] * height[i];
+		}
+		if (size > MAX_MIP_FLOATS) {
+			levels = 0;
+			texels.clear();
+			return false;
+		}
+		levels = count;
+		texels.resize(size);
+		return true;
+	}
+
+	// Fill every level after the first with the 2x2 box average of the level before it, bands of rows at a
+	// time on the pool. Level 0 must already hold the texture.
+	void Generate(ThreadPool& pool);
+
+	bool Empty() const { return levels == 0; }
+	float* Level(int i) { return texels.data() + offset[i]; }
+	const float* Level(int i) const { return texels.data() + offset[i]; }
+};
@@ -0,0 +1,28 @@
+#include "ResolutionScaler.h"
+#include <algorithm>
+#include <math.h>
+
+ResolutionScaler::ResolutionScaler(float target, float minimum)
+{
+	this->target = target;
+	this->minimum = minimum;
+	scale = 1.0f;
+}
+
+void ResolutionScaler::FrameSize(int windowWidth, int windowHeight, int& width, int& height) const
+{
+	width = std::max(1, (int)(windowWidth * scale + 0.5f));
+	height = std::max(1, (int)(windowHeight * scale + 0.5f));
+}
+
+void ResolutionScaler::Update(float milliseconds)
+{
+	// A frame a little under the target keeps the scale, so that it settles instead of oscillating
+	if (milliseconds <= target && milliseconds >= target * SCALE_SETTLE_BAND)
+		return;
+
+	// Steps are limited, so that a single frame slowed down by something else does not swing it far
+	float step = sqrtf(target / std::max(milliseconds, 0.001f));
+	step = std::min(SCALE_STEP_MAX, std::max(SCALE_STEP_MIN, step));
+	scale = std::min(1.0f, std::max(minimum, scale * step));
+}
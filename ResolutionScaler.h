@@ -0,0 +1,33 @@
+#pragma once
+
+
+#define SCALE_SETTLE_BAND 0.8f		// Frames between this fraction of the target and the target keep the scale
+#define SCALE_STEP_MIN 0.7f			// Largest change of the scale after a single frame, down and up
+#define SCALE_STEP_MAX 1.2f
+
+// Dynamic resolution: picks the size CPU frames are rendered at, as a fraction of the window size, so that
+// they take about a target time. Frame time mostly grows with the pixel count, so each side is scaled by the
+// square root of the ratio between the target and the last frame's time.
+class ResolutionScaler {
+private:
+	float target;			// Milliseconds
+	float minimum;
+	float scale;
+
+public:
+
+	ResolutionScaler(float target, float minimum);
+
+	void SetTarget(float target) { this->target = target; }
+	float Target() const { return target; }
+
+	// Fraction of the window size of each side, between the minimum and 1
+	float Scale() const { return scale; }
+	void Reset() { scale = 1.0f; }
+
+	// Size of the frame to render for a window of this size
+	void FrameSize(int windowWidth, int windowHeight, int& width, int& height) const;
+
+	// Adjust the scale after a frame rendered at it took this many milliseconds
+	void Update(float milliseconds);
+};
@@ -0,0 +1,552 @@
+#include "SpanSIMD.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SPAN_SIMD_X86
+// GCC 12 flags the deliberately undefined registers inside some AVX-512 intrinsics as maybe uninitialized
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <immintrin.h>
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef SPAN_SIMD_X86
+
+// MSVC emits any intrinsic without per-function target flags; GCC and Clang need them
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define FORCE_INLINE __forceinline
+#else
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#define FORCE_INLINE __attribute__((always_inline)) inline
+#endif
+
+// Helpers built from a trait's own operations. They take and return its vectors, so they are expanded inside
+// each trait to get its target attribute; as free templates they would pass the vectors without the
+// instruction set enabled, which changes the ABI.
+#define SIMD_HELPERS(TARGET) \
+	/* Vectorized Triangle::fastLog2 */ \
+	TARGET static F fastLog2(F x) { \
+		I bits = bitsOf(x); \
+		F exponent = toFloat(sub(shiftRight(bits, 23), set(127))); \
+		F mantissa = fromBits(bitOr(bitAnd(bits, set(0x007FFFFF)), set(0x3F800000))); \
+		return add(exponent, fmadd(fmadd(set(-0.34484843f), mantissa, set(2.02466578f)), mantissa, set(-0.67487759f))); \
+	} \
+	\
+	/* Value of a plane at the pixel of each lane, for lanes laid out as two rows starting at (x, y) */ \
+	TARGET static F planeStart(Plane& plane, int x, int y) { \
+		return fmadd(rowRamp(), set(plane.dy), set(plane.at(x, y))); \
+	} \
+	\
+	/* Edge values of the lanes of two rows starting at (x, y), in the two halves the edge ops work on */ \
+	TARGET static void edgeStart(FixedEdge& edge, int x, int y, E& low, E& high) { \
+		const int half = width / 2; \
+		long long start[width]; \
+		for (int l = 0; l < width; l++) \
+			start[l] = edge.at(x + l % half, y + l / half); \
+		low = loadEdge(start); \
+		high = loadEdge(start + half); \
+	} \
+	\
+	/* Vectorized Triangle::bilinear: filters the texels around texel coordinates (x, y) of each lane's */ \
+	/* levelWidth x levelHeight texture level, which starts base floats into texels, wrapping the */ \
+	/* coordinates and the taps into the level */ \
+	TARGET static void bilinear(M mask, const float* texels, I base, F levelWidth, F levelHeight, F x, F y, F(&color)[3]) { \
+		const F zero = set(0.0f), one = set(1.0f); \
+		const I three = set(3); \
+		x = sub(x, mul(floor(div(x, levelWidth)), levelWidth)); \
+		y = sub(y, mul(floor(div(y, levelHeight)), levelHeight)); \
+		\
+		/* Rounding can wrap a coordinate just below zero to the level size, so the lower tap is clamped inside */ \
+		F xFloor = min(floor(x), sub(levelWidth, one)), yFloor = min(floor(y), sub(levelHeight, one)); \
+		F fx = sub(x, xFloor), fy = sub(y, yFloor); \
+		F xNext = add(xFloor, one), yNext = add(yFloor, one); \
+		I x0 = toInt(xFloor), y0 = toInt(yFloor); \
+		I x1 = toInt(select(less(xNext, levelWidth), xNext, zero)); \
+		I y1 = toInt(select(less(yNext, levelHeight), yNext, zero)); \
+		\
+		I stride = toInt(levelWidth); \
+		I row0 = mul(y0, stride), row1 = mul(y1, stride); \
+		I i00 = add(base, mul(add(x0, row0), three)); \
+		I i01 = add(base, mul(add(x0, row1), three)); \
+		I i10 = add(base, mul(add(x1, row0), three)); \
+		I i11 = add(base, mul(add(x1, row1), three)); \
+		for (int c = 0; c < 3; c++) { \
+			F u00 = gather(mask, texels + c, i00); \
+			F u01 = gather(mask, texels + c, i01); \
+			F u10 = gather(mask, texels + c, i10); \
+			F u11 = gather(mask, texels + c, i11); \
+			F c0 = fmadd(fx, sub(u10, u00), u00); \
+			F c1 = fmadd(fx, sub(u11, u01), u01); \
+			color[c] = fmadd(fy, sub(c1, c0), c0); \
+		} \
+	} \
+	\
+	/* Vectorized Triangle::sampleLevel: bilinear sample of each lane's mip level at texel coordinates (u, v) */ \
+	/* of level 0. The levels share one allocation, so each lane gathers its level's size, scale and offset, */ \
+	/* the offsets from levelOffset as 32-bit indices like those of the texels. */ \
+	TARGET static void sampleLevel(M mask, MipPyramid& texture, const int* levelOffset, I level, F u, F v, F(&color)[3]) { \
+		const F halfTexel = set(0.5f); \
+		F levelWidth = toFloat(gather(mask, texture.width, level)); \
+		F levelHeight = toFloat(gather(mask, texture.height, level)); \
+		F x = sub(mul(add(u, halfTexel), gather(mask, texture.scaleX, level)), halfTexel); \
+		F y = sub(mul(add(v, halfTexel), gather(mask, texture.scaleY, level)), halfTexel); \
+		bilinear(mask, texture.texels.data(), gather(mask, levelOffset, level), levelWidth, levelHeight, x, y, color); \
+	}
+
+// 8-wide lanes, as two rows of four; masks are full-width float vectors
+struct Avx2 {
+	static const int width = 8;
+	typedef __m256 F;
+	typedef __m256i I;
+	typedef __m256 M;
+
+	TARGET_AVX2 static F set(float a) { return _mm256_set1_ps(a); }
+	TARGET_AVX2 static F columnRamp() { return _mm256_setr_ps(0, 1, 2, 3, 0, 1, 2, 3); }
+	TARGET_AVX2 static F rowRamp() { return _mm256_setr_ps(0, 0, 0, 0, 1, 1, 1, 1); }
+	TARGET_AVX2 static F add(F a, F b) { return _mm256_add_ps(a, b); }
+	TARGET_AVX2 static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+	TARGET_AVX2 static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+	TARGET_AVX2 static F div(F a, F b) { return _mm256_div_ps(a, b); }
+	TARGET_AVX2 static F fmadd(F a, F b, F c) { return _mm256_fmadd_ps(a, b, c); }
+	TARGET_AVX2 static F floor(F a) { return _mm256_floor_ps(a); }
+	TARGET_AVX2 static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+	TARGET_AVX2 static F max(F a, F b) { return _mm256_max_ps(a, b); }
+	TARGET_AVX2 static F min(F a, F b) { return _mm256_min_ps(a, b); }
+	TARGET_AVX2 static M less(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	TARGET_AVX2 static M lessEqual(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	TARGET_AVX2 static M both(M a, M b) { return _mm256_and_ps(a, b); }
+	TARGET_AVX2 static int bits(M m) { return _mm256_movemask_ps(m); }
+	TARGET_AVX2 static F select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+	TARGET_AVX2 static F load(M m, const float* p) { return _mm256_maskload_ps(p, _mm256_castps_si256(m)); }
+	TARGET_AVX2 static void store(M m, float* p, F a) { _mm256_maskstore_ps(p, _mm256_castps_si256(m), a); }
+	TARGET_AVX2 static void store(float* p, F a) { _mm256_storeu_ps(p, a); }
+
+	// Two rows of four pixels: the upper four lanes are stride floats after the lower four
+	TARGET_AVX2 static __m256i lowerRow() { return _mm256_setr_epi32(-1, -1, -1, -1, 0, 0, 0, 0); }
+	TARGET_AVX2 static F loadRows(M m, const float* p, int stride) {
+		__m256i lanes = _mm256_castps_si256(m);
+		return _mm256_or_ps(_mm256_maskload_ps(p, _mm256_and_si256(lanes, lowerRow())), _mm256_maskload_ps(p + stride - 4, _mm256_andnot_si256(lowerRow(), lanes)));
+	}
+	TARGET_AVX2 static void storeRows(M m, float* p, int stride, F a) {
+		__m256i lanes = _mm256_castps_si256(m);
+		_mm256_maskstore_ps(p, _mm256_and_si256(lanes, lowerRow()), a);
+		_mm256_maskstore_ps(p + stride - 4, _mm256_andnot_si256(lowerRow(), lanes), a);
+	}
+	TARGET_AVX2 static void storeRows(M m, int* p, int stride, I a) {
+		__m256i lanes = _mm256_castps_si256(m);
+		_mm256_maskstore_epi32(p, _mm256_and_si256(lanes, lowerRow()), a);
+		_mm256_maskstore_epi32(p + stride - 4, _mm256_andnot_si256(lowerRow(), lanes), a);
+	}
+
+	TARGET_AVX2 static I toInt(F a) { return _mm256_cvttps_epi32(a); }
+	TARGET_AVX2 static I set(int a) { return _mm256_set1_epi32(a); }
+	TARGET_AVX2 static I add(I a, I b) { return _mm256_add_epi32(a, b); }
+	TARGET_AVX2 static I mul(I a, I b) { return _mm256_mullo_epi32(a, b); }
+	TARGET_AVX2 static I sub(I a, I b) { return _mm256_sub_epi32(a, b); }
+	TARGET_AVX2 static I bitAnd(I a, I b) { return _mm256_and_si256(a, b); }
+	TARGET_AVX2 static I bitOr(I a, I b) { return _mm256_or_si256(a, b); }
+	TARGET_AVX2 static I shiftRight(I a, int n) { return _mm256_srli_epi32(a, n); }
+	TARGET_AVX2 static I bitsOf(F a) { return _mm256_castps_si256(a); }
+	TARGET_AVX2 static F fromBits(I a) { return _mm256_castsi256_ps(a); }
+	TARGET_AVX2 static F toFloat(I a) { return _mm256_cvtepi32_ps(a); }
+	TARGET_AVX2 static F gather(M m, const float* base, I index) { return _mm256_mask_i32gather_ps(_mm256_setzero_ps(), base, index, m, 4); }
+	TARGET_AVX2 static I gather(M m, const int* base, I index) { return _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), base, index, _mm256_castps_si256(m), 4); }
+
+	// Fixed-point edge values, in two halves of four 64-bit lanes
+	typedef __m256i E;
+	TARGET_AVX2 static E loadEdge(const long long* p) { return _mm256_loadu_si256((const __m256i*)p); }
+	TARGET_AVX2 static E setEdge(long long a) { return _mm256_set1_epi64x(a); }
+	TARGET_AVX2 static E addEdge(E a, E b) { return _mm256_add_epi64(a, b); }
+	TARGET_AVX2 static E eitherEdge(E a, E b) { return _mm256_or_si256(a, b); }
+	TARGET_AVX2 static M notNegative(E low, E high) {
+		// Collect the upper dwords, which hold the signs, in lane order
+		__m256 upper = _mm256_shuffle_ps(_mm256_castsi256_ps(low), _mm256_castsi256_ps(high), _MM_SHUFFLE(3, 1, 3, 1));
+		upper = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(upper), _MM_SHUFFLE(3, 1, 2, 0)));
+		return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_castps_si256(upper), _mm256_set1_epi32(-1)));
+	}
+
+	// fastLog2, planeStart, edgeStart, bilinear and sampleLevel
+	SIMD_HELPERS(TARGET_AVX2)
+};
+
+// 16-wide lanes, as two rows of eight; masks are AVX-512 mask registers
+struct Avx512 {
+	static const int width = 16;
+	typedef __m512 F;
+	typedef __m512i I;
+	typedef __mmask16 M;
+
+	TARGET_AVX512 static F set(float a) { return _mm512_set1_ps(a); }
+	TARGET_AVX512 static F columnRamp() { return _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7); }
+	TARGET_AVX512 static F rowRamp() { return _mm512_setr_ps(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1); }
+	TARGET_AVX512 static F add(F a, F b) { return _mm512_add_ps(a, b); }
+	TARGET_AVX512 static F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+	TARGET_AVX512 static F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+	TARGET_AVX512 static F div(F a, F b) { return _mm512_div_ps(a, b); }
+	TARGET_AVX512 static F fmadd(F a, F b, F c) { return _mm512_fmadd_ps(a, b, c); }
+	TARGET_AVX512 static F floor(F a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+	TARGET_AVX512 static F sqrt(F a) { return _mm512_sqrt_ps(a); }
+	TARGET_AVX512 static F max(F a, F b) { return _mm512_max_ps(a, b); }
+	TARGET_AVX512 static F min(F a, F b) { return _mm512_min_ps(a, b); }
+	TARGET_AVX512 static M less(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+	TARGET_AVX512 static M lessEqual(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+	TARGET_AVX512 static M both(M a, M b) { return a & b; }
+	TARGET_AVX512 static int bits(M m) { return m; }
+	TARGET_AVX512 static F select(M m, F a, F b) { return _mm512_mask_blend_ps(m, b, a); }
+	TARGET_AVX512 static F load(M m, const float* p) { return _mm512_maskz_loadu_ps(m, p); }
+	TARGET_AVX512 static void store(M m, float* p, F a) { _mm512_mask_storeu_ps(p, m, a); }
+	TARGET_AVX512 static void store(float* p, F a) { _mm512_storeu_ps(p, a); }
+
+	// Two rows of eight pixels: the upper eight lanes are stride floats after the lower eight
+	TARGET_AVX512 static F loadRows(M m, const float* p, int stride) {
+		return _mm512_mask_loadu_ps(_mm512_maskz_loadu_ps(m & 0x00FF, p), m & 0xFF00, p + stride - 8);
+	}
+	TARGET_AVX512 static void storeRows(M m, float* p, int stride, F a) {
+		_mm512_mask_storeu_ps(p, m & 0x00FF, a);
+		_mm512_mask_storeu_ps(p + stride - 8, m & 0xFF00, a);
+	}
+	TARGET_AVX512 static void storeRows(M m, int* p, int stride, I a) {
+		_mm512_mask_storeu_epi32(p, m & 0x00FF, a);
+		_mm512_mask_storeu_epi32(p + stride - 8, m & 0xFF00, a);
+	}
+
+	TARGET_AVX512 static I toInt(F a) { return _mm512_cvttps_epi32(a); }
+	TARGET_AVX512 static I set(int a) { return _mm512_set1_epi32(a); }
+	TARGET_AVX512 static I add(I a, I b) { return _mm512_add_epi32(a, b); }
+	TARGET_AVX512 static I mul(I a, I b) { return _mm512_mullo_epi32(a, b); }
+	TARGET_AVX512 static I sub(I a, I b) { return _mm512_sub_epi32(a, b); }
+	TARGET_AVX512 static I bitAnd(I a, I b) { return _mm512_and_si512(a, b); }
+	TARGET_AVX512 static I bitOr(I a, I b) { return _mm512_or_si512(a, b); }
+	TARGET_AVX512 static I shiftRight(I a, int n) { return _mm512_srli_epi32(a, n); }
+	TARGET_AVX512 static I bitsOf(F a) { return _mm512_castps_si512(a); }
+	TARGET_AVX512 static F fromBits(I a) { return _mm512_castsi512_ps(a); }
+	TARGET_AVX512 static F toFloat(I a) { return _mm512_cvtepi32_ps(a); }
+	TARGET_AVX512 static F gather(M m, const float* base, I index) { return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), m, index, base, 4); }
+	TARGET_AVX512 static I gather(M m, const int* base, I index) { return _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), m, index, base, 4); }
+
+	// Fixed-point edge values, in two halves of eight 64-bit lanes
+	typedef __m512i E;
+	TARGET_AVX512 static E loadEdge(const long long* p) { return _mm512_loadu_si512(p); }
+	TARGET_AVX512 static E setEdge(long long a) { return _mm512_set1_epi64(a); }
+	TARGET_AVX512 static E addEdge(E a, E b) { return _mm512_add_epi64(a, b); }
+	TARGET_AVX512 static E eitherEdge(E a, E b) { return _mm512_or_si512(a, b); }
+	TARGET_AVX512 static M notNegative(E low, E high) {
+		__mmask8 lowMask = _mm512_cmpge_epi64_mask(low, _mm512_setzero_si512());
+		__mmask8 highMask = _mm512_cmpge_epi64_mask(high, _mm512_setzero_si512());
+		return (M)(lowMask | (highMask << 8));
+	}
+
+	// fastLog2, planeStart, edgeStart, bilinear and sampleLevel
+	SIMD_HELPERS(TARGET_AVX512)
+};
+
+// The span functions below are written once for every trait, so they cannot carry its target attribute; GCC
+// then notes that the vectors they get from the trait's operations would change the ABI of a call. No such
+// call is made: they are force inlined into the per-target wrappers further down, which do carry it.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+// Vectorized counterpart of Triangle::ShadeSpan: coverage, depth test, color and texture addressing
+// for a line of 2x2 quads at once (V::width / 2 pixels of each row), with lane masks in place of the
+// scalar branches. Force inlined into the per-target wrappers below, which compile it for their
+// instruction set and each shading mode.
+template <class V, ShadingMode mode>
+FORCE_INLINE static void ShadeSpanSIMD(TriangleSetup& setup, Shading& shading, int y, int rows, int xStart, int xEnd, float* r, float* g, float* b, float* z, int rowStride, bool inside)
+{
+	typedef typename V::F F;
+	typedef typename V::I I;
+	typedef typename V::M M;
+	typedef typename V::E E;
+
+	const F zero = V::set(0.0f);
+	const F tw = V::set((float)shading.tw);
+	const F th = V::set((float)shading.th);
+	const I stride = V::set(shading.tw);
+	const I three = V::set(3);
+
+	// Edge values of the first quads, and their step to the next ones
+	const int half = V::width / 2;
+	E edge[3][2], edgeStep[3];
+	if (!inside) {
+		for (int k = 0; k < 3; k++) {
+			V::edgeStart(setup.edges[k], xStart, y, edge[k][0], edge[k][1]);
+			edgeStep[k] = V::setEdge(setup.edges[k].dx * half);
+		}
+	}
+
+	// Start values of each lane and per-pixel gradients
+	F z0 = V::planeStart(setup.zPlane, xStart, y), dz = V::set(setup.zPlane.dx);
+	F u0 = V::planeStart(setup.uPlane, xStart, y), du = V::set(setup.uPlane.dx);
+	F v0 = V::planeStart(setup.vPlane, xStart, y), dv = V::set(setup.vPlane.dx);
+	F w0 = V::planeStart(setup.wPlane, xStart, y), dw = V::set(setup.wPlane.dx);
+	F duy = V::set(setup.uPlane.dy), dvy = V::set(setup.vPlane.dy), dwy = V::set(setup.wPlane.dy);
+	F r0 = V::planeStart(setup.rPlane, xStart, y), dr = V::set(setup.rPlane.dx);
+	F g0 = V::planeStart(setup.gPlane, xStart, y), dg = V::set(setup.gPlane.dx);
+	F b0 = V::planeStart(setup.bPlane, xStart, y), db = V::set(setup.bPlane.dx);
+	M rowMask = V::less(V::rowRamp(), V::set((float)rows));
+
+	// Level offsets as 32-bit gather indices, like the texel indices added to them; Allocate keeps every
+	// index of the pyramid within MAX_MIP_FLOATS
+	int levelOffset[MAX_MIP_LEVELS];
+	if (mode == SHADE_MIPMAP) {
+		for (int i = 0; i < shading.texture->levels; i++)
+			levelOffset[i] = (int)shading.texture->offset[i];
+	}
+
+	int count = xEnd - xStart + 1;
+	for (int i = 0; i < count; i += half) {
+		F lane = V::add(V::set((float)i), V::columnRamp());
+		M mask = V::both(rowMask, V::less(lane, V::set((float)count)));
+
+		// Check inside triangle: all three edge values have their sign bit clear
+		if (!inside) {
+			E low = V::eitherEdge(V::eitherEdge(edge[0][0], edge[1][0]), edge[2][0]);
+			E high = V::eitherEdge(V::eitherEdge(edge[0][1], edge[1][1]), edge[2][1]);
+			mask = V::both(mask, V::notNegative(low, high));
+			for (int k = 0; k < 3; k++) {
+				edge[k][0] = V::addEdge(edge[k][0], edgeStep[k]);
+				edge[k][1] = V::addEdge(edge[k][1], edgeStep[k]);
+			}
+			if (!V::bits(mask)) { continue; }
+		}
+
+		// Check depth buffer
+		F depth = V::fmadd(lane, dz, z0);
+		mask = V::both(mask, V::less(depth, V::loadRows(mask, z + i, rowStride)));
+		if (!V::bits(mask)) { continue; }
+
+		F red, green, blue;
+		if (mode == SHADE_COLOR) {
+			red = V::fmadd(lane, dr, r0);
+			green = V::fmadd(lane, dg, g0);
+			blue = V::fmadd(lane, db, b0);
+		}
+		else {
+			F Qw = V::fmadd(lane, dw, w0);
+			F u = V::mul(V::div(V::fmadd(lane, du, u0), Qw), tw);
+			F v = V::mul(V::div(V::fmadd(lane, dv, v0), Qw), th);
+
+			if (mode == SHADE_MIPMAP) {
+				// Level of detail from the analytic derivatives of the texture coordinates, as in Triangle::mipLevel,
+				// so that a pixel gets the same level whatever span function shades it and wherever the span starts
+				F w = V::div(V::set(1.0f), Qw);
+				F dudx = V::mul(V::sub(V::mul(du, tw), V::mul(u, dw)), w);
+				F dvdx = V::mul(V::sub(V::mul(dv, th), V::mul(v, dw)), w);
+				F dudy = V::mul(V::sub(V::mul(duy, tw), V::mul(u, dwy)), w);
+				F dvdy = V::mul(V::sub(V::mul(dvy, th), V::mul(v, dwy)), w);
+				F lengthSquared = V::max(V::fmadd(dudx, dudx, V::mul(dvdx, dvdx)), V::fmadd(dudy, dudy, V::mul(dvdy, dvdy)));
+				F level = V::mul(V::set(0.5f), V::fastLog2(lengthSquared));
+				F top = V::set((float)(shading.texture->levels - 1));
+				level = V::min(V::max(level, zero), top);
+
+				// Blend the two nearest levels
+				F lower = V::floor(level);
+				F upper = V::min(V::add(lower, V::set(1.0f)), top);
+				F c1[3], c2[3];
+				V::sampleLevel(mask, *shading.texture, levelOffset, V::toInt(lower), u, v, c1);
+				V::sampleLevel(mask, *shading.texture, levelOffset, V::toInt(upper), u, v, c2);
+				F fraction = V::sub(level, lower);
+				red = V::fmadd(fraction, V::sub(c2[0], c1[0]), c1[0]);
+				green = V::fmadd(fraction, V::sub(c2[1], c1[1]), c1[1]);
+				blue = V::fmadd(fraction, V::sub(c2[2], c1[2]), c1[2]);
+			}
+			else if (mode == SHADE_NEAREST) {
+				// Wrap into the texture and gather the texels
+				u = V::sub(u, V::mul(V::floor(V::div(u, tw)), tw));
+				v = V::sub(v, V::mul(V::floor(V::div(v, th)), th));
+				const float* texels = shading.texture->Level(0);
+				I x0 = V::toInt(V::min(V::floor(u), V::sub(tw, V::set(1.0f))));
+				I y0 = V::toInt(V::min(V::floor(v), V::sub(th, V::set(1.0f))));
+				I index = V::mul(V::add(x0, V::mul(y0, stride)), three);
+				red = V::gather(mask, texels, index);
+				green = V::gather(mask, texels + 1, index);
+				blue = V::gather(mask, texels + 2, index);
+			}
+			else {
+				F channel[3];
+				V::bilinear(mask, shading.texture->Level(0), V::set(0), tw, th, u, v, channel);
+				red = channel[0];
+				green = channel[1];
+				blue = channel[2];
+			}
+		}
+
+		V::storeRows(mask, r + i, rowStride, red);
+		V::storeRows(mask, g + i, rowStride, green);
+		V::storeRows(mask, b + i, rowStride, blue);
+		V::storeRows(mask, z + i, rowStride, depth);
+	}
+}
+
+// Vectorized counterpart of Triangle::VisibilitySpan: coverage and depth test only, writing depth and id
+template <class V>
+FORCE_INLINE static void VisibilitySpanSIMD(TriangleSetup& setup, int y, int rows, int xStart, int xEnd, float* z, int* ids, int rowStride, int id, bool inside)
+{
+	typedef typename V::F F;
+	typedef typename V::M M;
+	typedef typename V::E E;
+
+	const int half = V::width / 2;
+	E edge[3][2], edgeStep[3];
+	if (!inside) {
+		for (int k = 0; k < 3; k++) {
+			V::edgeStart(setup.edges[k], xStart, y, edge[k][0], edge[k][1]);
+			edgeStep[k] = V::setEdge(setup.edges[k].dx * half);
+		}
+	}
+
+	F z0 = V::planeStart(setup.zPlane, xStart, y), dz = V::set(setup.zPlane.dx);
+	typename V::I idLanes = V::set(id);
+	M rowMask = V::less(V::rowRamp(), V::set((float)rows));
+
+	int count = xEnd - xStart + 1;
+	for (int i = 0; i < count; i += half) {
+		F lane = V::add(V::set((float)i), V::columnRamp());
+		M mask = V::both(rowMask, V::less(lane, V::set((float)count)));
+
+		if (!inside) {
+			E low = V::eitherEdge(V::eitherEdge(edge[0][0], edge[1][0]), edge[2][0]);
+			E high = V::eitherEdge(V::eitherEdge(edge[0][1], edge[1][1]), edge[2][1]);
+			mask = V::both(mask, V::notNegative(low, high));
+			for (int k = 0; k < 3; k++) {
+				edge[k][0] = V::addEdge(edge[k][0], edgeStep[k]);
+				edge[k][1] = V::addEdge(edge[k][1], edgeStep[k]);
+			}
+			if (!V::bits(mask)) { continue; }
+		}
+
+		F depth = V::fmadd(lane, dz, z0);
+		mask = V::both(mask, V::less(depth, V::loadRows(mask, z + i, rowStride)));
+		V::storeRows(mask, z + i, rowStride, depth);
+		V::storeRows(mask, ids + i, rowStride, idLanes);
+	}
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+TARGET_AVX2 static void VisibilitySpanAVX2(TriangleSetup& setup, int y, int rows, int xStart, int xEnd, float* z, int* ids, int stride, int id, bool inside)
+{
+	VisibilitySpanSIMD<Avx2>(setup, y, rows, xStart, xEnd, z, ids, stride, id, inside);
+}
+
+TARGET_AVX512 static void VisibilitySpanAVX512(TriangleSetup& setup, int y, int rows, int xStart, int xEnd, float* z, int* ids, int stride, int id, bool inside)
+{
+	VisibilitySpanSIMD<Avx512>(setup, y, rows, xStart, xEnd, z, ids, stride, id, inside);
+}
+
+template <ShadingMode mode>
+TARGET_AVX2 static void ShadeSpanAVX2(TriangleSetup& setup, Shading& shading, int y, int rows, int xStart, int xEnd, float* r, float* g, float* b, float* z, int stride, bool inside)
+{
+	ShadeSpanSIMD<Avx2, mode>(setup, shading, y, rows, xStart, xEnd, r, g, b, z, stride, inside);
+}
+
+template <ShadingMode mode>
+TARGET_AVX512 static void ShadeSpanAVX512(TriangleSetup& setup, Shading& shading, int y, int rows, int xStart, int xEnd, float* r, float* g, float* b, float* z, int stride, bool inside)
+{
+	ShadeSpanSIMD<Avx512, mode>(setup, shading, y, rows, xStart, xEnd, r, g, b, z, stride, inside);
+}
+
+// Query CPUID, and XGETBV for OS support of the wider register state
+static void DetectFeatures(bool& avx2, bool& avx512)
+{
+	avx2 = false;
+	avx512 = false;
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+	if (!osxsave)
+		return;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	avx2 = fma && (info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6;
+	avx512 = avx2 && (info[1] & (1 << 16)) && (xcr0 & 0xE6) == 0xE6;
+#else
+	__builtin_cpu_init();
+	avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	avx512 = avx2 && __builtin_cpu_supports("avx512f");
+#endif
+}
+
+#endif
+
+// Span functions of each instruction set, indexed by shading mode
+static const SpanFunction scalarSpans[SHADING_MODES] = {
+	Triangle::ShadeSpan<SHADE_COLOR>, Triangle::ShadeSpan<SHADE_NEAREST>, Triangle::ShadeSpan<SHADE_BILINEAR>, Triangle::ShadeSpan<SHADE_MIPMAP>
+};
+static const SpanFunction multisampleSpans[SHADING_MODES] = {
+	Triangle::ShadeSpanMultisample<SHADE_COLOR>, Triangle::ShadeSpanMultisample<SHADE_NEAREST>, Triangle::ShadeSpanMultisample<SHADE_BILINEAR>, Triangle::ShadeSpanMultisample<SHADE_MIPMAP>
+};
+#ifdef SPAN_SIMD_X86
+static const SpanFunction avx2Spans[SHADING_MODES] = {
+	ShadeSpanAVX2<SHADE_COLOR>, ShadeSpanAVX2<SHADE_NEAREST>, ShadeSpanAVX2<SHADE_BILINEAR>, ShadeSpanAVX2<SHADE_MIPMAP>
+};
+static const SpanFunction avx512Spans[SHADING_MODES] = {
+	ShadeSpanAVX512<SHADE_COLOR>, ShadeSpanAVX512<SHADE_NEAREST>, ShadeSpanAVX512<SHADE_BILINEAR>, ShadeSpanAVX512<SHADE_MIPMAP>
+};
+#endif
+
+// Widest instruction set of the CPU: 0 scalar, 1 AVX2, 2 AVX-512. Detected once.
+static int InstructionSetLevel()
+{
+#ifdef SPAN_SIMD_X86
+	static const int level = [] {
+		bool avx2, avx512;
+		DetectFeatures(avx2, avx512);
+		return avx512 ? 2 : avx2 ? 1 : 0;
+	}();
+	return level;
+#else
+	return 0;
+#endif
+}
+
+SpanFunction SelectSpanFunction(ShadingMode mode)
+{
+#ifdef SPAN_SIMD_X86
+	if (InstructionSetLevel() == 2)
+		return avx512Spans[mode];
+	if (InstructionSetLevel() == 1)
+		return avx2Spans[mode];
+#endif
+	return scalarSpans[mode];
+}
+
+SpanFunction SelectMultisampleSpanFunction(ShadingMode mode)
+{
+	return multisampleSpans[mode];
+}
+
+VisibilityFunction SelectVisibilityFunction()
+{
+#ifdef SPAN_SIMD_X86
+	if (InstructionSetLevel() == 2)
+		return VisibilitySpanAVX512;
+	if (InstructionSetLevel() == 1)
+		return VisibilitySpanAVX2;
+#endif
+	return Triangle::VisibilitySpan;
+}
+
+const char* SpanInstructionSet()
+{
+	static const char* names[] = { "scalar", "AVX2", "AVX-512" };
+	return names[InstructionSetLevel()];
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "Triangle.h"
+
+
+// Pick the widest span function this CPU supports (AVX-512, AVX2, or the scalar Triangle::ShadeSpan),
+// specialized for a shading mode
+SpanFunction SelectSpanFunction(ShadingMode mode);
+
+// Multisampled span function (Triangle::ShadeSpanMultisample) for a shading mode. It is scalar on every
+// CPU: samples are tested four to a pixel, and each pixel is still shaded only once.
+SpanFunction SelectMultisampleSpanFunction(ShadingMode mode);
+
+// Visibility function for the same instruction set as SelectSpanFunction
+VisibilityFunction SelectVisibilityFunction();
+
+// Name of the instruction set the span functions use, for logging
+const char* SpanInstructionSet();
@@ -0,0 +1,87 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threadCount)
+{
+	if (threadCount <= 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	job = nullptr;
+	jobCount = 0;
+	next = 0;
+	generation = 0;
+	busy = 0;
+	stopping = false;
+
+	for (int i = 1; i < threadCount; i++)
+		threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int, int)>& body)
+{
+	if (count <= 0)
+		return;
+
+	// Not worth waking the workers
+	if (threads.empty() || count == 1)
+	{
+		for (int i = 0; i < count; i++)
+			body(i, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &body;
+		jobCount = count;
+		next = 0;
+		busy = threads.size();
+		generation++;
+	}
+	wake.notify_all();
+
+	RunJob(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return busy == 0; });
+	job = nullptr;
+}
+
+void ThreadPool::WorkerLoop(int worker)
+{
+	int seen = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+
+		RunJob(worker);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--busy == 0)
+			done.notify_one();
+	}
+}
+
+void ThreadPool::RunJob(int worker)
+{
+	for (int i = next++; i < jobCount; i = next++)
+		(*job)(i, worker);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+
+// Fixed set of worker threads that run the iterations of a loop in parallel
+class ThreadPool {
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;		// Signals workers that a new loop is available
+	std::condition_variable done;		// Signals the caller that every worker has finished
+	const std::function<void(int, int)>* job;
+	int jobCount;
+	std::atomic<int> next;				// Next loop index to hand out
+	int generation;						// Incremented for every loop
+	int busy;							// Workers still running the current loop
+	bool stopping;
+
+	void WorkerLoop(int worker);
+	void RunJob(int worker);
+
+public:
+
+	// Start threadCount - 1 workers; the calling thread acts as worker 0. Zero uses every hardware thread.
+	ThreadPool(int threadCount = 0);
+	~ThreadPool();
+
+	// Number of threads taking part in a loop, including the caller
+	int size() { return threads.size() + 1; }
+
+	// Call body(index, worker) for every index in [0, count) and wait for all of them to finish
+	void ParallelFor(int count, const std::function<void(int, int)>& body);
+};
@@ -0,0 +1,772 @@
+#include "TileRenderer.h"
+#include <chrono>
+#include <limits>
+#include <unordered_map>
+#include <string.h>
+
+// Hashes a position by its bits, so only exactly equal positions are merged. -0 and +0 compare equal, so
+// zeros are hashed as +0.
+struct PositionHash {
+	size_t operator()(const glm::vec3& p) const
+	{
+		float coordinates[3];
+		for (int i = 0; i < 3; i++)
+			coordinates[i] = p[i] == 0.0f ? 0.0f : p[i];
+		unsigned int bits[3];
+		memcpy(bits, coordinates, sizeof(bits));
+		return ((size_t)bits[0] * 73856093) ^ ((size_t)bits[1] * 19349663) ^ ((size_t)bits[2] * 83492791);
+	}
+};
+
+static float millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+TileRenderer::TileRenderer()
+{
+	tilesX = 0;
+	tilesY = 0;
+	indexedMesh = NULL;
+	indexedCount = 0;
+	sortedView = glm::vec3(0.0f);
+	tiles.resize(pool.size());
+	span = SelectSpanFunction(SHADE_COLOR);
+	visibility = SelectVisibilityFunction();
+	cullBackFaces = false;
+	deferred = false;
+	depthSort = true;
+	multisample = false;
+	reproject = false;
+	historyCurrent = 0;
+	reprojectedFrames = 0;
+	rasterTime = 0.0f;
+	warpTime = 0.0f;
+	skippedWarps = 0;
+	InvalidateHistory();
+}
+
+void TileRenderer::Render(std::vector<Triangle>& triangles, glm::mat4& modelViewMatrix, glm::mat4& projectionMatrix, FrameBuffer& frame, bool isTextured, int textureMode, MipPyramid& texture, int tw, int th)
+{
+	int w = frame.Width();
+	int h = frame.Height();
+	tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+
+	if (triangles.data() != indexedMesh || triangles.size() != indexedCount)
+		IndexVertices(triangles);
+	if (depthSort)
+		SortTriangles(modelViewMatrix);
+
+	// Vertices: every unique position is transformed once
+	glm::mat4 modelViewProjection = projectionMatrix * modelViewMatrix;
+	int numVertices = positions.size();
+	int numVertexChunks = std::max(1, std::min(numVertices, 4 * pool.size()));
+	transformed.resize(numVertices);
+	pool.ParallelFor(numVertexChunks, [&](int chunk, int) {
+		int first = (long long)numVertices * chunk / numVertexChunks;
+		int last = (long long)numVertices * (chunk + 1) / numVertexChunks;
+		TransformVertices(first, last, modelViewProjection);
+	});
+
+	// Reprojection: the last frame can stand in for this one where the scene and shading are the same, and
+	// this frame is kept in the other history for the next one
+	History* previous = NULL;
+	History* next = NULL;
+	if (reproject)
+	{
+		previous = &history[historyCurrent];
+		historyCurrent ^= 1;
+		next = &history[historyCurrent];
+		next->valid = false;
+		next->color.Resize(w, h, frame.Format());
+		next->depth.resize((size_t)w * h);
+		next->offset.resize((size_t)w * h);
+		next->modelViewProjection = modelViewProjection;
+		next->isTextured = isTextured;
+		next->textureMode = textureMode;
+
+		if (previous->valid && previous->color.Width() == w && previous->color.Height() == h && previous->color.Format() == frame.Format()
+			&& previous->isTextured == isTextured && previous->textureMode == textureMode)
+		{
+			// Pixel position and depth in the last frame, through its model space, to homogeneous pixel position
+			// and depth in this one
+			glm::mat4 ndcFromScreen(1.0f);
+			ndcFromScreen[0][0] = 2.0f / w;
+			ndcFromScreen[1][1] = 2.0f / h;
+			ndcFromScreen[3][0] = -1.0f;
+			ndcFromScreen[3][1] = -1.0f;
+			glm::mat4 screenFromNdc(1.0f);
+			screenFromNdc[0][0] = w * 0.5f;
+			screenFromNdc[1][1] = h * 0.5f;
+			screenFromNdc[3][0] = w * 0.5f;
+			screenFromNdc[3][1] = h * 0.5f;
+			warp = screenFromNdc * modelViewProjection * glm::inverse(previous->modelViewProjection) * ndcFromScreen;
+		}
+		else
+		{
+			previous = NULL;
+		}
+
+		// The warp saves the rasterization of the tiles it fills. Where that is less than it costs, as with
+		// light meshes, frames are rendered in full, though still kept, and the warp is only timed again
+		// every REPROJECT_RETRY frames in case the scene got heavier.
+		if (previous && warpTime >= rasterTime && ++skippedWarps < REPROJECT_RETRY)
+			previous = NULL;
+		else if (previous)
+			skippedWarps = 0;
+	}
+
+	// Tiles found entirely in the last frame are not rasterized, unless it is their turn to be refreshed.
+	// This runs before the geometry, so that triangles only they cover are never set up.
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	reprojected.clear();
+	if (previous)
+	{
+		reprojectedFrames++;
+		reprojected.resize(tilesX * tilesY);
+		pool.ParallelFor(tilesX * tilesY, [&](int tile, int) {
+			int x0 = (tile % tilesX) * TILE_SIZE;
+			int y0 = (tile / tilesX) * TILE_SIZE;
+			int width = std::min(TILE_SIZE, w - x0);
+			int height = std::min(TILE_SIZE, h - y0);
+			reprojected[tile] = (tile + reprojectedFrames) % REPROJECT_REFRESH != 0 && ReprojectTile(x0, y0, width, height, frame, *previous, *next);
+		});
+	}
+
+	// Geometry: assemble and cull, then set up and bin contiguous chunks of triangles in parallel.
+	// Each chunk has its own lists, so the draw order inside a tile is kept without locking.
+	bool multisampled = multisample && !deferred;
+	int numTriangles = triangles.size();
+	int numChunks = std::max(1, std::min(numTriangles, 4 * pool.size()));
+	survivors.resize(numChunks);
+	setups.resize(numChunks);
+	bins.resize(numChunks);
+	pool.ParallelFor(numChunks, [&](int chunk, int) {
+		int first = (long long)numTriangles * chunk / numChunks;
+		int last = (long long)numTriangles * (chunk + 1) / numChunks;
+		Cull(triangles, chunk, first, last, h, w);
+		SetupAndBin(chunk, h, w, multisampled);
+	});
+
+	// Which tiles of the frame are known to hold only the clear color, from earlier frames into the same buffer
+	if (frame.ClearedTiles().size() != static_cast<size_t>(tilesX * tilesY))
+		frame.ClearedTiles().assign(tilesX * tilesY, 0);
+
+	// Rasterization: each worker takes whole tiles
+	Shading shading = { isTextured, textureMode, &texture, tw, th };
+	ShadingMode mode = GetShadingMode(shading);
+	span = multisampled ? SelectMultisampleSpanFunction(mode) : SelectSpanFunction(mode);
+	pool.ParallelFor(tilesX * tilesY, [&](int tile, int worker) {
+		RenderTile(tile, worker, frame, shading, multisampled, next);
+	});
+	if (next)
+		next->valid = true;
+	if (previous)
+		warpTime = millisecondsSince(start);
+	else
+		rasterTime = millisecondsSince(start);
+}
+
+void TileRenderer::IndexVertices(std::vector<Triangle>& triangles)
+{
+	std::unordered_map<glm::vec3, int, PositionHash> unique;
+	positions.clear();
+	indices.resize(3 * triangles.size());
+	for (size_t i = 0; i < triangles.size(); i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			glm::vec3& position = *triangles[i].getVertPos(j);
+			auto found = unique.find(position);
+			if (found == unique.end())
+			{
+				found = unique.insert(std::make_pair(position, (int)positions.size())).first;
+				positions.push_back(position);
+			}
+			indices[3 * i + j] = found->second;
+		}
+	}
+	indexedMesh = triangles.data();
+	indexedCount = triangles.size();
+	order.clear();
+}
+
+void TileRenderer::SortTriangles(glm::mat4& modelViewMatrix)
+{
+	// View-space depth grows along the negated third row of the model-view matrix, so its direction
+	// alone orders the triangles; zooming and panning keep the order.
+	glm::vec3 view = -glm::normalize(glm::vec3(modelViewMatrix[0][2], modelViewMatrix[1][2], modelViewMatrix[2][2]));
+	int numTriangles = indices.size() / 3;
+	if (order.size() == static_cast<size_t>(numTriangles) && glm::dot(view, sortedView) > SORT_VIEW_COS)
+		return;
+
+	// Depth of each centroid, up to a common scale and offset
+	std::vector<float> keys(numTriangles);
+	float minKey = std::numeric_limits<float>::max();
+	float maxKey = -std::numeric_limits<float>::max();
+	for (int i = 0; i < numTriangles; i++)
+	{
+		glm::vec3 centroid = positions[indices[3 * i]] + positions[indices[3 * i + 1]] + positions[indices[3 * i + 2]];
+		keys[i] = glm::dot(centroid, view);
+		minKey = std::min(minKey, keys[i]);
+		maxKey = std::max(maxKey, keys[i]);
+	}
+
+	// Counting sort into coarse buckets, stable so the mesh order is kept within a bucket
+	float scale = maxKey > minKey ? (SORT_BUCKETS - 1) / (maxKey - minKey) : 0.0f;
+	std::vector<int> buckets(numTriangles);
+	std::vector<int> start(SORT_BUCKETS + 1, 0);
+	for (int i = 0; i < numTriangles; i++)
+	{
+		buckets[i] = (int)((keys[i] - minKey) * scale);
+		start[buckets[i] + 1]++;
+	}
+	for (int k = 0; k < SORT_BUCKETS; k++)
+		start[k + 1] += start[k];
+	order.resize(numTriangles);
+	for (int i = 0; i < numTriangles; i++)
+		order[start[buckets[i]]++] = i;
+	sortedView = view;
+}
+
+void TileRenderer::TransformVertices(int first, int last, glm::mat4& modelViewProjection)
+{
+	// Columns of the matrix, so each vertex is three multiply-adds of whole vectors
+	glm::vec4 column0 = modelViewProjection[0];
+	glm::vec4 column1 = modelViewProjection[1];
+	glm::vec4 column2 = modelViewProjection[2];
+	glm::vec4 column3 = modelViewProjection[3];
+	for (int i = first; i < last; i++)
+	{
+		glm::vec3& p = positions[i];
+		transformed[i].position = column0 * p.x + column1 * p.y + column2 * p.z + column3;
+		transformed[i].code = Triangle::outcode(transformed[i].position);
+	}
+}
+
+void TileRenderer::Cull(std::vector<Triangle>& triangles, int chunk, int first, int last, int h, int w)
+{
+	// Compact the triangles that can be visible, so setup never sees the rest
+	std::vector<ClipTriangle>& chunkSurvivors = survivors[chunk];
+	chunkSurvivors.clear();
+	ClipTriangle triangle;
+	for (int n = first; n < last; n++)
+	{
+		int i = depthSort ? order[n] : n;
+		if (!triangles[i].AssembleCPU(transformed.data(), &indices[3 * i], cullBackFaces, triangle))
+			continue;
+
+		// Triangles that only cover reprojected tiles are not needed this frame
+		if (!reprojected.empty() && InsideReprojected(triangle, h, w))
+			continue;
+		chunkSurvivors.push_back(triangle);
+	}
+}
+
+bool TileRenderer::InsideReprojected(ClipTriangle& triangle, int h, int w)
+{
+	// Only triangles in front of the near plane and inside the guard band project to a bounded box
+	if ((triangle.codes[0] | triangle.codes[1] | triangle.codes[2]) & ((1 << CLIP_PLANES) - 1))
+		return false;
+
+	// Pixel bounding box, widened by a pixel for rounding and multisampling
+	glm::vec2 minimum(std::numeric_limits<float>::max());
+	glm::vec2 maximum(-std::numeric_limits<float>::max());
+	for (int i = 0; i < 3; i++)
+	{
+		glm::vec4& position = triangle.vertices[i].position;
+		glm::vec2 screen((position.x / position.w + 1.0f) * (w * 0.5f), (position.y / position.w + 1.0f) * (h * 0.5f));
+		minimum = glm::min(minimum, screen);
+		maximum = glm::max(maximum, screen);
+	}
+	int xMin = (int)std::max(minimum.x - 1.0f, 0.0f);
+	int yMin = (int)std::max(minimum.y - 1.0f, 0.0f);
+	int xMax = (int)std::max(std::min(maximum.x + 1.0f, w - 1.0f), 0.0f);
+	int yMax = (int)std::max(std::min(maximum.y + 1.0f, h - 1.0f), 0.0f);
+
+	for (int ty = yMin / TILE_SIZE; ty <= yMax / TILE_SIZE; ty++)
+		for (int tx = xMin / TILE_SIZE; tx <= xMax / TILE_SIZE; tx++)
+			if (!reprojected[ty * tilesX + tx])
+				return false;
+	return true;
+}
+
+void TileRenderer::SetupAndBin(int chunk, int h, int w, bool multisampled)
+{
+	std::vector<ClipTriangle>& chunkSurvivors = survivors[chunk];
+	std::vector<TriangleSetup>& chunkSetups = setups[chunk];
+	std::vector<std::vector<int>>& chunkBins = bins[chunk];
+	chunkSetups.clear();
+	chunkBins.resize(tilesX * tilesY);
+	for (size_t i = 0; i < chunkBins.size(); i++)
+		chunkBins[i].clear();
+
+	TriangleSetup clipped[MAX_CLIPPED_TRIANGLES];
+	for (size_t i = 0; i < chunkSurvivors.size(); i++)
+	{
+		int count = Triangle::SetupCPU(chunkSurvivors[i], h, w, multisampled, clipped);
+		for (int j = 0; j < count; j++)
+		{
+			TriangleSetup& setup = clipped[j];
+			int index = chunkSetups.size();
+			chunkSetups.push_back(setup);
+
+			for (int ty = setup.yMin / TILE_SIZE; ty <= setup.yMax / TILE_SIZE; ty++)
+				for (int tx = setup.xMin / TILE_SIZE; tx <= setup.xMax / TILE_SIZE; tx++)
+					chunkBins[ty * tilesX + tx].push_back(index);
+		}
+	}
+}
+
+// Copies a tile between frames of the same size and format
+static void copyTile(FrameBuffer& source, FrameBuffer& destination, int x0, int y0, int width, int height)
+{
+	size_t bytes = width * source.PixelSize();
+	for (int y = y0; y < y0 + height; y++)
+		memcpy(destination.Row(y) + x0 * source.PixelSize(), source.Row(y) + x0 * source.PixelSize(), bytes);
+}
+
+void TileRenderer::RenderTile(int tile, int worker, FrameBuffer& frame, Shading& shading, bool multisampled, History* next)
+{
+	Tile& buffer = tiles[worker];
+	int x0 = (tile % tilesX) * TILE_SIZE;
+	int y0 = (tile / tilesX) * TILE_SIZE;
+	int width = std::min(TILE_SIZE, frame.Width() - x0);
+	int height = std::min(TILE_SIZE, frame.Height() - y0);
+
+	// Reprojected tiles are already in the frame and in the next history
+	if (!reprojected.empty() && reprojected[tile])
+	{
+		frame.ClearedTiles()[tile] = 0;
+		return;
+	}
+
+	// A tile no triangle touches is never materialized: its part of the frame only needs the clear
+	// color, and not even that when the frame still has it from an earlier frame
+	bool empty = true;
+	for (size_t chunk = 0; chunk < bins.size() && empty; chunk++)
+		empty = bins[chunk][tile].empty();
+	if (empty)
+	{
+		if (!frame.ClearedTiles()[tile])
+		{
+			frame.Clear(x0, y0, width, height);
+			frame.ClearedTiles()[tile] = 1;
+		}
+		if (next)
+			SaveTile(buffer, x0, y0, width, height, frame, multisampled, true, *next);
+		return;
+	}
+	frame.ClearedTiles()[tile] = 0;
+
+	// Only the buffers of this frame's sample count are cleared
+	if (multisampled)
+	{
+		memset(buffer.sampleColor, 0, sizeof(buffer.sampleColor));
+		std::fill(&buffer.sampleDepth[0][0], &buffer.sampleDepth[0][0] + TILE_SIZE * TILE_SIZE * MSAA_SAMPLES, std::numeric_limits<float>::infinity());
+	}
+	else
+	{
+		memset(buffer.color, 0, sizeof(buffer.color));
+		std::fill(&buffer.depth[0][0], &buffer.depth[0][0] + TILE_SIZE * TILE_SIZE, std::numeric_limits<float>::infinity());
+	}
+	for (int y = 0; y < TILE_SIZE / COARSE_BLOCK; y++)
+	{
+		for (int x = 0; x < TILE_SIZE / COARSE_BLOCK; x++)
+		{
+			buffer.hiZ[y][x] = std::numeric_limits<float>::infinity();
+			buffer.hiZDirty[y][x] = false;
+		}
+	}
+
+	if (deferred)
+	{
+		// Visibility pass: depth and triangle ids only
+		for (int y = 0; y < TILE_SIZE; y++)
+			for (int x = 0; x < TILE_SIZE; x++)
+				buffer.id[y][x] = -1;
+		buffer.triangles.clear();
+
+		auto record = [&](TriangleSetup& setup, int y, int rows, int xStart, int xEnd, bool inside) {
+			int i = y - y0;
+			int j = xStart - x0;
+			visibility(setup, y, rows, xStart, xEnd, &buffer.depth[i][j], &buffer.id[i][j], TILE_SIZE, buffer.triangles.size() - 1, inside);
+		};
+		for (size_t chunk = 0; chunk < bins.size(); chunk++)
+		{
+			std::vector<int>& bin = bins[chunk][tile];
+			for (size_t i = 0; i < bin.size(); i++)
+			{
+				buffer.triangles.push_back(&setups[chunk][bin[i]]);
+				Triangle::RenderCPU<1>(setups[chunk][bin[i]], buffer.depth, buffer.hiZ, buffer.hiZDirty, x0, y0, record);
+			}
+		}
+
+		ShadeVisible(buffer, x0, y0, width, height, shading);
+	}
+	else if (multisampled)
+	{
+		auto shade = [&](TriangleSetup& setup, int y, int rows, int xStart, int xEnd, bool inside) {
+			int i = y - y0;
+			int j = (xStart - x0) * MSAA_SAMPLES;
+			span(setup, shading, y, rows, xStart, xEnd, &buffer.sampleColor[0][i][j], &buffer.sampleColor[1][i][j], &buffer.sampleColor[2][i][j], &buffer.sampleDepth[i][j], TILE_SIZE * MSAA_SAMPLES, inside);
+		};
+		for (size_t chunk = 0; chunk < bins.size(); chunk++)
+		{
+			std::vector<int>& bin = bins[chunk][tile];
+			for (size_t i = 0; i < bin.size(); i++)
+				Triangle::RenderCPU<MSAA_SAMPLES>(setups[chunk][bin[i]], buffer.sampleDepth, buffer.hiZ, buffer.hiZDirty, x0, y0, shade);
+		}
+
+		// Resolve: each pixel is the average of its samples
+		for (int c = 0; c < 3; c++)
+		{
+			for (int y = 0; y < height; y++)
+			{
+				for (int x = 0; x < width; x++)
+				{
+					float sum = 0.0f;
+					for (int s = 0; s < MSAA_SAMPLES; s++)
+						sum += buffer.sampleColor[c][y][x * MSAA_SAMPLES + s];
+					buffer.color[c][y][x] = sum * (1.0f / MSAA_SAMPLES);
+				}
+			}
+		}
+	}
+	else
+	{
+		auto shade = [&](TriangleSetup& setup, int y, int rows, int xStart, int xEnd, bool inside) {
+			int i = y - y0;
+			int j = xStart - x0;
+			span(setup, shading, y, rows, xStart, xEnd, &buffer.color[0][i][j], &buffer.color[1][i][j], &buffer.color[2][i][j], &buffer.depth[i][j], TILE_SIZE, inside);
+		};
+		for (size_t chunk = 0; chunk < bins.size(); chunk++)
+		{
+			std::vector<int>& bin = bins[chunk][tile];
+			for (size_t i = 0; i < bin.size(); i++)
+				Triangle::RenderCPU<1>(setups[chunk][bin[i]], buffer.depth, buffer.hiZ, buffer.hiZDirty, x0, y0, shade);
+		}
+	}
+
+	// Converted once: into the history when it is kept, and copied from there
+	if (next)
+	{
+		SaveTile(buffer, x0, y0, width, height, frame, multisampled, false, *next);
+		copyTile(next->color, frame, x0, y0, width, height);
+	}
+	else
+	{
+		WriteTile(buffer, x0, y0, width, height, frame);
+	}
+}
+
+// Whether a pixel of the last frame has background next to it, where a surface ends
+static inline bool nearBackground(const float* depth, int x, int y, int w, int h)
+{
+	const float infinity = std::numeric_limits<float>::infinity();
+	return (x > 0 && !(depth[(size_t)y * w + x - 1] < infinity)) || (x < w - 1 && !(depth[(size_t)y * w + x + 1] < infinity))
+		|| (y > 0 && !(depth[(size_t)(y - 1) * w + x] < infinity)) || (y < h - 1 && !(depth[(size_t)(y + 1) * w + x] < infinity));
+}
+
+bool TileRenderer::ReprojectTile(int x0, int y0, int width, int height, FrameBuffer& frame, History& previous, History& next)
+{
+	int w = frame.Width();
+	int h = frame.Height();
+	const float infinity = std::numeric_limits<float>::infinity();
+	const float* previousDepth = previous.depth.data();
+	const PixelOffset* previousOffset = previous.offset.data();
+	float* nextDepth = next.depth.data();
+	PixelOffset* nextOffset = next.offset.data();
+	glm::mat4 motion = warp;	// Kept local, where the stores to the history cannot alias it
+	bool rgba8 = frame.Format() == COLOR_RGBA8;
+
+	// A tile that was all background is left to the rasterizer, which is as quick to find it still empty
+	bool surface = false;
+	for (int y = y0; y < y0 + height; y++)
+	{
+		const float* depth = &previousDepth[(size_t)y * w + x0];
+		for (int x = 0; x < width; x++)
+			surface |= depth[x] < infinity;
+	}
+	if (!surface)
+		return false;
+
+	// Pixels of the tile a surface of the last frame landed in, found at the first pixel no surface is
+	// found for
+	bool covered[TILE_SIZE][TILE_SIZE];
+	bool coverageFound = false;
+
+	for (int y = y0; y < y0 + height; y++)
+	{
+		// Fixed-point iteration for the pixel of the last frame whose surface point moved onto each pixel: step
+		// back by the motion of the surface found there until it lands inside the pixel. Surface points are
+		// tracked rather than pixel centers, so what a pixel holds is never more than the tolerance away from
+		// where it belongs, however many frames it was carried over. Motion is smooth across a surface, so the
+		// search starts at the offset found for the pixel to the left and mostly ends there.
+		int offsetX = 0;
+		int offsetY = 0;
+		float py = y + 0.5f;
+		unsigned char* nextColor = next.color.Row(y);
+		for (int x = x0; x < x0 + width; x++)
+		{
+			float px = x + 0.5f;
+			int sx = x + offsetX;
+			int sy = y + offsetY;
+			size_t pixel = (size_t)y * w + x;
+			bool found = false;
+			float nearest = std::numeric_limits<float>::max();
+			int nearestX = sx;
+			int nearestY = sy;
+			float nearestDX = 0.0f;
+			float nearestDY = 0.0f;
+			float nearestZ = 0.0f;
+			int lastX = -1;
+			int lastY = -1;
+			for (int i = 0; i <= REPROJECT_ITERATIONS; i++)
+			{
+				if (sx < 0 || sx >= w || sy < 0 || sy >= h)
+					break;
+				size_t source = (size_t)sy * w + sx;
+				if (!(previousDepth[source] < infinity))
+					break;
+				glm::vec2 point(sx + 0.5f + previousOffset[source].x * (1.0f / REPROJECT_SUBPIXEL), sy + 0.5f + previousOffset[source].y * (1.0f / REPROJECT_SUBPIXEL));
+				glm::vec4 moved = motion[0] * point.x + motion[1] * point.y + motion[2] * previousDepth[source] + motion[3];
+				if (!(moved.w > 0.0f))
+					break;
+				float inverse = 1.0f / moved.w;
+				float dx = moved.x * inverse - px;
+				float dy = moved.y * inverse - py;
+				if (fabsf(dx) <= 0.5f && fabsf(dy) <= 0.5f)
+				{
+					nextDepth[pixel] = moved.z * inverse;
+					nextOffset[pixel].x = (signed char)(dx * REPROJECT_SUBPIXEL);
+					nextOffset[pixel].y = (signed char)(dy * REPROJECT_SUBPIXEL);
+					found = true;
+					break;
+				}
+				float distance = std::max(fabsf(dx), fabsf(dy));
+				if (distance < nearest)
+				{
+					nearest = distance;
+					nearestX = sx;
+					nearestY = sy;
+					nearestDX = dx;
+					nearestDY = dy;
+					nearestZ = moved.z * inverse;
+				}
+
+				// Far off, step back by the motion found; close by, the points of the pixels next to this one
+				// are each within a pixel of where it would be, so step to the one on the side of the miss. A
+				// step back to where the last one came from means no point lands inside.
+				int nextX;
+				int nextY;
+				if (fabsf(dx) > 1.0f || fabsf(dy) > 1.0f)
+				{
+					float qx = point.x - dx;
+					float qy = point.y - dy;
+					if (!(qx >= 0.0f && qx < w && qy >= 0.0f && qy < h))
+						break;
+					nextX = (int)qx;
+					nextY = (int)qy;
+				}
+				else
+				{
+					nextX = sx - (dx > 0.5f) + (dx < -0.5f);
+					nextY = sy - (dy > 0.5f) + (dy < -0.5f);
+				}
+				if (nextX == lastX && nextY == lastY)
+					break;
+				lastX = sx;
+				lastY = sy;
+				sx = nextX;
+				sy = nextY;
+			}
+
+			// One no point lands inside was in front of what is now visible (a disocclusion), unless the surface
+			// was stretched between samples. Then the nearest point is taken to be inside, so that the next frame
+			// still has a point in every pixel to find; the rolling refresh makes up for what that moves it. A
+			// point at the edge of a surface may not stand in for a pixel beside it, which may well be background.
+			if (!found && nearest <= REPROJECT_TOLERANCE && !nearBackground(previousDepth, nearestX, nearestY, w, h))
+			{
+				sx = nearestX;
+				sy = nearestY;
+				nextDepth[pixel] = nearestZ;
+				nextOffset[pixel].x = (signed char)(glm::clamp(nearestDX, -0.5f, 0.5f) * REPROJECT_SUBPIXEL);
+				nextOffset[pixel].y = (signed char)(glm::clamp(nearestDY, -0.5f, 0.5f) * REPROJECT_SUBPIXEL);
+				found = true;
+			}
+			if (!found)
+			{
+				// Background, if no surface lands in it; otherwise disoccluded. A pixel that had a surface
+				// is rasterized without looking: one moved off it, or was covered by another.
+				if (previousDepth[pixel] < infinity)
+					return false;
+				if (!coverageFound)
+				{
+					if (!FindCoverage(x0, y0, width, height, w, h, previous, covered))
+						return false;
+					coverageFound = true;
+				}
+				if (covered[y - y0][x - x0] || x < REPROJECT_MARGIN || x >= w - REPROJECT_MARGIN || y < REPROJECT_MARGIN || y >= h - REPROJECT_MARGIN)
+					return false;
+				nextDepth[pixel] = infinity;
+				nextOffset[pixel].x = 0;
+				nextOffset[pixel].y = 0;
+				if (rgba8)
+				{
+					unsigned char* color = nextColor + x * 4;
+					color[0] = color[1] = color[2] = 0;
+					color[3] = 255;
+				}
+				else
+				{
+					memset(nextColor + x * 3 * sizeof(float), 0, 3 * sizeof(float));
+				}
+				continue;
+			}
+			offsetX = sx - x;
+			offsetY = sy - y;
+			if (rgba8)
+				memcpy(nextColor + x * 4, previous.color.Row(sy) + sx * 4, 4);
+			else
+				memcpy(nextColor + x * 3 * sizeof(float), previous.color.Row(sy) + sx * 3 * sizeof(float), 3 * sizeof(float));
+		}
+	}
+
+	// The tile goes to the frame as saved for the next one
+	copyTile(next.color, frame, x0, y0, width, height);
+	return true;
+}
+
+// A pixel no surface of the last frame is found for is background if no surface lands in it. Surfaces
+// are looked for within REPROJECT_MARGIN pixels of the tile; one that moved farther than that leaves the
+// question open, and the tile to be rasterized.
+bool TileRenderer::FindCoverage(int x0, int y0, int width, int height, int w, int h, History& previous, bool (&covered)[TILE_SIZE][TILE_SIZE])
+{
+	const float* previousDepth = previous.depth.data();
+	const PixelOffset* previousOffset = previous.offset.data();
+	glm::mat4 motion = warp;
+	memset(covered, 0, sizeof(covered));
+	int xFirst = std::max(0, x0 - REPROJECT_MARGIN);
+	int xLast = std::min(w, x0 + width + REPROJECT_MARGIN);
+	int yFirst = std::max(0, y0 - REPROJECT_MARGIN);
+	int yLast = std::min(h, y0 + height + REPROJECT_MARGIN);
+	for (int sy = yFirst; sy < yLast; sy++)
+	{
+		for (int sx = xFirst; sx < xLast; sx++)
+		{
+			size_t source = (size_t)sy * w + sx;
+			if (!(previousDepth[source] < std::numeric_limits<float>::infinity()))
+				continue;
+			glm::vec2 point(sx + 0.5f + previousOffset[source].x * (1.0f / REPROJECT_SUBPIXEL), sy + 0.5f + previousOffset[source].y * (1.0f / REPROJECT_SUBPIXEL));
+			glm::vec4 moved = motion[0] * point.x + motion[1] * point.y + motion[2] * previousDepth[source] + motion[3];
+			if (!(moved.w > 0.0f))
+				return false;
+			glm::vec2 position(moved.x / moved.w, moved.y / moved.w);
+			if (!(fabsf(position.x - point.x) <= REPROJECT_MARGIN && fabsf(position.y - point.y) <= REPROJECT_MARGIN))
+				return false;
+
+			// The pixel it landed in
+			float tileX = position.x - x0;
+			float tileY = position.y - y0;
+			if (tileX >= 0.0f && tileX < width && tileY >= 0.0f && tileY < height)
+				covered[(int)tileY][(int)tileX] = true;
+		}
+	}
+	return true;
+}
+
+void TileRenderer::SaveTile(Tile& buffer, int x0, int y0, int width, int height, FrameBuffer& frame, bool multisampled, bool empty, History& next)
+{
+	// Color converted from the tile, which the frame is then copied from rather than read back: it may be
+	// mapped write-combined memory. Depth is the nearest of each pixel, sampled at its center.
+	if (!empty)
+		WriteTile(buffer, x0, y0, width, height, next.color);
+	for (int y = 0; y < height; y++)
+	{
+		float* depth = &next.depth[(size_t)(y0 + y) * frame.Width() + x0];
+		memset(&next.offset[(size_t)(y0 + y) * frame.Width() + x0], 0, width * sizeof(PixelOffset));
+		if (empty)
+		{
+			std::fill(depth, depth + width, std::numeric_limits<float>::infinity());
+			continue;
+		}
+
+		for (int x = 0; x < width; x++)
+		{
+			if (multisampled)
+			{
+				float nearest = buffer.sampleDepth[y][x * MSAA_SAMPLES];
+				for (int s = 1; s < MSAA_SAMPLES; s++)
+					nearest = std::min(nearest, buffer.sampleDepth[y][x * MSAA_SAMPLES + s]);
+				depth[x] = nearest;
+			}
+			else
+			{
+				depth[x] = buffer.depth[y][x];
+			}
+		}
+	}
+}
+
+// Rounds a color channel to an unsigned normalized byte; NaN becomes 0
+static inline unsigned char toUnorm8(float value)
+{
+	return (unsigned char)(std::min(1.0f, std::max(0.0f, value)) * 255.0f + 0.5f);
+}
+
+void TileRenderer::WriteTile(Tile& buffer, int x0, int y0, int width, int height, FrameBuffer& frame)
+{
+	// Interleave the finished tile into the frame, converting to its format
+	for (int y = 0; y < height; y++)
+	{
+		unsigned char* first = frame.Row(y0 + y) + x0 * frame.PixelSize();
+		if (frame.Format() == COLOR_RGBA8)
+		{
+			unsigned char* row = first;
+			for (int x = 0; x < width; x++)
+			{
+				row[4 * x + 0] = toUnorm8(buffer.color[0][y][x]);
+				row[4 * x + 1] = toUnorm8(buffer.color[1][y][x]);
+				row[4 * x + 2] = toUnorm8(buffer.color[2][y][x]);
+				row[4 * x + 3] = 255;
+			}
+		}
+		else
+		{
+			float* row = (float*)first;
+			for (int x = 0; x < width; x++)
+			{
+				row[3 * x + 0] = buffer.color[0][y][x];
+				row[3 * x + 1] = buffer.color[1][y][x];
+				row[3 * x + 2] = buffer.color[2][y][x];
+			}
+		}
+	}
+}
+
+void TileRenderer::ShadeVisible(Tile& buffer, int x0, int y0, int width, int height, Shading& shading)
+{
+	// Each run of pixels with the same id in a row is shaded by one span call. The span's depth test
+	// must pass, so it is pointed at a scratch row of infinite depth instead of the tile depth.
+	float scratch[TILE_SIZE];
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width;)
+		{
+			int id = buffer.id[y][x];
+			int run = x + 1;
+			while (run < width && buffer.id[y][run] == id)
+				run++;
+
+			if (id >= 0)
+			{
+				for (int i = x; i < run; i++)
+					scratch[i] = std::numeric_limits<float>::infinity();
+				span(*buffer.triangles[id], shading, y0 + y, 1, x0 + x, x0 + run - 1, &buffer.color[0][y][x], &buffer.color[1][y][x], &buffer.color[2][y][x], &scratch[x], TILE_SIZE, true);
+			}
+			x = run;
+		}
+	}
+}
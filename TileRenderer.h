@@ -0,0 +1,158 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Triangle.h"
+#include "ThreadPool.h"
+#include "SpanSIMD.h"
+#include "FrameBuffer.h"
+
+#define TILE_SIZE 64
+#define SORT_BUCKETS 1024		// Depth buckets of the front-to-back triangle order
+#define SORT_VIEW_COS 0.99f		// Re-sort once the view direction turns by more than about 8 degrees
+#define REPROJECT_ITERATIONS 3		// Fixed-point steps to find the pixel of the last frame that lands on a pixel
+#define REPROJECT_TOLERANCE 1.0f	// Pixels a reprojected sample may land from the pixel it fills
+#define REPROJECT_REFRESH 8			// Every tile is rasterized again at least once in this many reprojected frames
+#define REPROJECT_MARGIN 8			// Pixels around a tile searched for surfaces that may have moved into its background
+#define REPROJECT_SUBPIXEL 254.0f	// Steps per pixel of the surface point offsets kept for reprojection
+#define REPROJECT_RETRY 30			// Frames the warp is skipped for, when it does not pay off, before it is timed again
+
+// Tile-local color and depth buffers, small enough to stay in L1/L2 while the tile is rasterized.
+// Color is planar so that span functions can load and store whole SIMD registers per channel.
+struct Tile {
+	float color[3][TILE_SIZE][TILE_SIZE];
+	float depth[TILE_SIZE][TILE_SIZE];
+	float hiZ[TILE_SIZE / COARSE_BLOCK][TILE_SIZE / COARSE_BLOCK];		// Farthest depth in each coarse block (an upper bound)
+	bool hiZDirty[TILE_SIZE / COARSE_BLOCK][TILE_SIZE / COARSE_BLOCK];	// Block written since its hiZ was computed
+
+	// Multisampled color and depth: the MSAA_SAMPLES samples of each pixel are side by side
+	float sampleColor[3][TILE_SIZE][TILE_SIZE * MSAA_SAMPLES];
+	float sampleDepth[TILE_SIZE][TILE_SIZE * MSAA_SAMPLES];
+
+	// Visibility buffer: index into triangles of the nearest triangle at each pixel, or -1
+	int id[TILE_SIZE][TILE_SIZE];
+	std::vector<TriangleSetup*> triangles;
+};
+
+// Where in a pixel the surface point it holds is, from its center, in steps of 1 / REPROJECT_SUBPIXEL of a
+// pixel: half a pixel either way. A byte per axis keeps the history small enough to stream every frame.
+struct PixelOffset {
+	signed char x, y;
+};
+
+// A finished frame kept for reprojection: its color in the frame's format, its depth per pixel (infinite
+// where nothing was drawn), and what it was rendered with
+struct History {
+	FrameBuffer color;
+	std::vector<float> depth;
+	std::vector<PixelOffset> offset;		// Surface point each pixel holds; the center where rasterized
+	glm::mat4 modelViewProjection;
+	bool isTextured;
+	int textureMode;
+	bool valid;
+};
+
+// Sort-middle CPU renderer: triangles are set up once per frame, binned into screen tiles,
+// and the tiles are rasterized independently on a thread pool. Tiles are either shaded as
+// triangles are drawn (forward), or get a visibility buffer of triangle ids first and are
+// shaded once per visible pixel afterwards (deferred).
+class TileRenderer {
+private:
+	ThreadPool pool;
+	std::vector<glm::vec3> positions;				// Unique vertex positions of the mesh
+	std::vector<int> indices;						// Three indices into positions per triangle
+	const Triangle* indexedMesh;					// Triangles positions and indices were built from
+	size_t indexedCount;
+	std::vector<TransformedVertex> transformed;		// positions in clip space, for the current frame
+	std::vector<int> order;							// Triangle indices sorted front to back along sortedView
+	glm::vec3 sortedView;							// Model-space view direction order was sorted for
+	std::vector<std::vector<ClipTriangle>> survivors;	// survivors[chunk]: triangles of a chunk that passed culling
+	std::vector<std::vector<TriangleSetup>> setups;	// setups[chunk]: set up (and clipped) triangles of a chunk
+	std::vector<std::vector<std::vector<int>>> bins;	// bins[chunk][tile]: indices into setups[chunk] overlapping a tile
+	std::vector<Tile> tiles;						// One tile buffer per worker
+	int tilesX, tilesY;
+	SpanFunction span;								// Widest span function the CPU supports, for this frame's shading mode
+	VisibilityFunction visibility;
+	bool cullBackFaces;
+	bool deferred;
+	bool depthSort;
+	bool multisample;
+	bool reproject;
+	History history[2];							// The last frame and the one being rendered, alternately
+	int historyCurrent;							// Index of the last frame in history
+	glm::mat4 warp;								// Pixel position and depth in the last frame to homogeneous ones in this frame
+	int reprojectedFrames;						// Frames rendered with reprojection, to pick the tiles refreshed
+	std::vector<char> reprojected;				// Per tile: filled from the last frame this frame; empty when none is
+	float rasterTime;							// Milliseconds to cull, bin and rasterize the last frame rendered in full
+	float warpTime;								// Milliseconds to warp, cull, bin and rasterize the last warped frame
+	int skippedWarps;							// Frames in a row the warp was skipped for not paying off
+
+	void IndexVertices(std::vector<Triangle>& triangles);
+	void SortTriangles(glm::mat4& modelViewMatrix);
+	void TransformVertices(int first, int last, glm::mat4& modelViewProjection);
+	void Cull(std::vector<Triangle>& triangles, int chunk, int first, int last, int h, int w);
+	bool InsideReprojected(ClipTriangle& triangle, int h, int w);
+	void SetupAndBin(int chunk, int h, int w, bool multisampled);
+	void RenderTile(int tile, int worker, FrameBuffer& frame, Shading& shading, bool multisampled, History* next);
+	bool ReprojectTile(int x0, int y0, int width, int height, FrameBuffer& frame, History& previous, History& next);
+	bool FindCoverage(int x0, int y0, int width, int height, int w, int h, History& previous, bool (&covered)[TILE_SIZE][TILE_SIZE]);
+	void SaveTile(Tile& buffer, int x0, int y0, int width, int height, FrameBuffer& frame, bool multisampled, bool empty, History& next);
+	void WriteTile(Tile& buffer, int x0, int y0, int width, int height, FrameBuffer& frame);
+	void ShadeVisible(Tile& buffer, int x0, int y0, int width, int height, Shading& shading);
+
+public:
+
+	TileRenderer();
+
+	// Instruction set of the span function in use
+	const char* SpanName() { return SpanInstructionSet(); }
+
+	// Worker threads, idle between frames, for other parallel work such as building a texture's mip levels
+	ThreadPool& Pool() { return pool; }
+
+	// Back-face culling, off by default. Only valid for closed meshes with counter-clockwise front faces.
+	void SetBackFaceCulling(bool enabled) { cullBackFaces = enabled; InvalidateHistory(); }
+	bool BackFaceCulling() { return cullBackFaces; }
+
+	// Deferred shading through a visibility buffer, off by default. Pays off with overdraw and costly shading.
+	void SetDeferred(bool enabled) { deferred = enabled; }
+	bool Deferred() { return deferred; }
+
+	// Front-to-back draw order, on by default, so the depth test rejects more fragments before shading.
+	// Triangles are bucketed by depth along the view direction, and only re-sorted when it turns enough.
+	void SetDepthSort(bool enabled) { depthSort = enabled; order.clear(); }
+	bool DepthSort() { return depthSort; }
+
+	// 4x multisample anti-aliasing, off by default: coverage and depth per sample, shading once per pixel,
+	// and the samples averaged as each tile is written out. Forward shading only; the visibility buffer
+	// of deferred shading keeps one sample per pixel.
+	void SetMultisample(bool enabled) { multisample = enabled; InvalidateHistory(); }
+	bool Multisample() { return multisample; }
+
+	// Temporal reprojection, off by default. Each tile is first warped from the last frame with its depth and
+	// the change of the transform; tiles with pixels that cannot be found in it (disoccluded, or background
+	// that geometry may now cover) are rasterized. Pixels keep track of the surface point they hold, so they
+	// stay within a pixel of it, and a rolling subset of tiles is rasterized every frame so that shading
+	// changes do not last. Meant for small camera moves between frames, such as orbiting.
+	// The warp costs about as much per pixel as rasterizing a light mesh, so it only saves time on heavy
+	// ones: it is timed against the rasterization it saves, and skipped while it does not pay off. Warped
+	// pixels are resampled from the last frame, so some of them, mostly at edges, stay slightly off the
+	// image a full render would give until their tile is refreshed.
+	void SetReprojection(bool enabled) { reproject = enabled; InvalidateHistory(); }
+	bool Reprojection() { return reproject; }
+
+	// The next frame is rendered in full. Call when the triangles or their colors change, since the last
+	// frame is only valid for the same scene.
+	void InvalidateHistory() { history[0].valid = false; history[1].valid = false; }
+
+	// Forget the vertex index, so that it is rebuilt on the next frame. Call after loading a mesh or moving
+	// its vertices: a new mesh can reuse the allocation and size of the last one.
+	void InvalidateMesh() { indexedMesh = NULL; indexedCount = 0; InvalidateHistory(); }
+
+	// Render the triangles into frame, at its size and in its format. Vertex positions are shared between
+	// triangles through an index built the first time a mesh is seen; they must not change afterwards
+	// without a call to InvalidateMesh.
+	void Render(std::vector<Triangle>& triangles, glm::mat4& modelViewMatrix, glm::mat4& projectionMatrix, FrameBuffer& frame, bool isTextured, int textureMode, MipPyramid& texture, int tw, int th);
+};
@@ -108,4 +108,190 @@ void Triangle::RenderOpenGL(glm::mat4 &modelViewMatrix, glm::mat4 &projectionMat
 }
 
 
-// Render the triangle on CPU
+// Signed distance of a clip-space position to one of the clip planes; inside when >= 0
+static float planeDistance(glm::vec4& p, int plane)
+{
+	switch (plane) {
+	case 0: return p.z + p.w;				// Near plane
+	case 1: return GUARD_BAND * p.w - p.x;	// Guard band right
+	case 2: return GUARD_BAND * p.w + p.x;	// Guard band left
+	case 3: return GUARD_BAND * p.w - p.y;	// Guard band top
+	case 4: return GUARD_BAND * p.w + p.y;	// Guard band bottom
+	case 5: return p.w - p.z;				// Far plane
+	case 6: return p.w - p.x;				// Frustum right
+	case 7: return p.w + p.x;				// Frustum left
+	case 8: return p.w - p.y;				// Frustum top
+	default: return p.w + p.y;				// Frustum bottom
+	}
+}
+
+// Bit i is set when the position is outside plane i. The planes of planeDistance, written out
+// so that the per-vertex test has no branches.
+int Triangle::outcode(glm::vec4& p)
+{
+	float band = GUARD_BAND * p.w;
+	return (p.z + p.w < 0) | (band - p.x < 0) << 1 | (band + p.x < 0) << 2 | (band - p.y < 0) << 3 | (band + p.y < 0) << 4
+		| (p.w - p.z < 0) << 5 | (p.w - p.x < 0) << 6 | (p.w + p.x < 0) << 7 | (p.w - p.y < 0) << 8 | (p.w + p.y < 0) << 9;
+}
+
+// Point where the edge a-b crosses a clip plane, with the attributes interpolated alongside
+static ClipVertex intersect(ClipVertex& a, ClipVertex& b, float da, float db)
+{
+	float t = da / (da - db);
+	ClipVertex p;
+	p.position = a.position + t * (b.position - a.position);
+	p.texCoord = a.texCoord + t * (b.texCoord - a.texCoord);
+	p.color = a.color + t * (b.color - a.color);
+	return p;
+}
+
+// Gather the transformed verticies of the triangle and cull it against the view frustum and, optionally, its facing
+bool Triangle::AssembleCPU(const TransformedVertex* transformed, const int* index, bool cullBackFaces, ClipTriangle& out)
+{
+	const TransformedVertex& v0 = transformed[index[0]];
+	const TransformedVertex& v1 = transformed[index[1]];
+	const TransformedVertex& v2 = transformed[index[2]];
+
+	// Entirely outside one plane of the frustum
+	if (v0.code & v1.code & v2.code)
+		return false;
+
+	// The determinant of the (x, y, w) rows has the sign of the screen-space area when every w is positive,
+	// and still tells front from back when the triangle crosses the eye plane. Counter-clockwise is front.
+	if (cullBackFaces) {
+		const glm::vec4& a = v0.position;
+		const glm::vec4& b = v1.position;
+		const glm::vec4& c = v2.position;
+		float det = a.x * (b.y * c.w - c.y * b.w) - b.x * (a.y * c.w - c.y * a.w) + c.x * (a.y * b.w - b.y * a.w);
+		if (det <= 0)
+			return false;
+	}
+
+	const TransformedVertex* vertices[3] = { &v0, &v1, &v2 };
+	for (int i = 0; i < 3; i++) {
+		out.vertices[i].position = vertices[i]->position;
+		out.vertices[i].texCoord = t[i];
+		out.vertices[i].color = c[i];
+		out.codes[i] = vertices[i]->code;
+	}
+	return true;
+}
+
+// Set up a transformed triangle for rendering on CPU
+int Triangle::SetupCPU(ClipTriangle& triangle, int h, int w, bool multisample, TriangleSetup* setups)
+{
+	ClipVertex polygon[MAX_CLIP_VERTICES];
+	for (int i = 0; i < 3; i++)
+		polygon[i] = triangle.vertices[i];
+
+	// Entirely inside the near plane and the guard band
+	int crossed = (triangle.codes[0] | triangle.codes[1] | triangle.codes[2]) & ((1 << CLIP_PLANES) - 1);
+	if (!crossed)
+		return SetupClipped(polygon, h, w, multisample, setups[0]) ? 1 : 0;
+
+	// Clip against the near plane and the guard band only where needed (Sutherland-Hodgman)
+	int count = 3;
+	for (int plane = 0; plane < CLIP_PLANES && count > 0; plane++) {
+		if (!(crossed & (1 << plane)))
+			continue;
+
+		ClipVertex clipped[MAX_CLIP_VERTICES];
+		int clippedCount = 0;
+		for (int i = 0; i < count; i++) {
+			ClipVertex& a = polygon[i];
+			ClipVertex& b = polygon[(i + 1) % count];
+			float da = planeDistance(a.position, plane);
+			float db = planeDistance(b.position, plane);
+			if (da >= 0)
+				clipped[clippedCount++] = a;
+			if ((da >= 0) != (db >= 0))
+				clipped[clippedCount++] = intersect(a, b, da, db);
+		}
+		count = clippedCount;
+		for (int i = 0; i < count; i++)
+			polygon[i] = clipped[i];
+	}
+
+	// Triangulate the clipped polygon as a fan
+	int numSetups = 0;
+	for (int i = 1; i + 1 < count; i++) {
+		ClipVertex fan[3] = { polygon[0], polygon[i], polygon[i + 1] };
+		if (SetupClipped(fan, h, w, multisample, setups[numSetups]))
+			numSetups++;
+	}
+	return numSetups;
+}
+
+// Set up a triangle that lies inside the near plane and the guard band
+bool Triangle::SetupClipped(ClipVertex vertices[3], int h, int w, bool multisample, TriangleSetup& setup)
+{
+	// Convert verticies to NDC then to screen space
+	glm::vec4 ndc[3];
+	float wInv[3];	// Perspective correct interpolation
+	glm::vec2 Qsca[3];
+	glm::vec4 screenCoords[3];	// Vertex coords in screenspace
+
+	// Viewport transform: NDC x and y scaled and offset to pixels, z kept
+	float halfWidth = w / 2;
+	float halfHeight = h / 2;
+	for (int i = 0; i < 3; i++) {
+		ndc[i] = vertices[i].position;
+		wInv[i] = 1 / ndc[i].w;
+		Qsca[i] = vertices[i].texCoord * wInv[i];
+		ndc[i] /= ndc[i].w;
+		screenCoords[i] = glm::vec4(ndc[i].x * halfWidth + halfWidth, ndc[i].y * halfHeight + halfHeight, ndc[i].z, 1);
+	}
+
+	// Snap to 24.8 fixed point. The guard band keeps coordinates far below the +-2^22 pixels
+	// that would overflow the 64-bit edge functions; the check only guards against NaNs.
+	long long X[3], Y[3];
+	glm::vec4 snapped[3];	// Snapped coordinates, shifted so that pixel centers fall on integers
+	for (int i = 0; i < 3; i++) {
+		if (!(fabs(screenCoords[i].x) < MAX_SCREEN_COORD && fabs(screenCoords[i].y) < MAX_SCREEN_COORD))
+			return false;
+		X[i] = (long long)floor(screenCoords[i].x * (double)SUBPIXEL_SCALE + 0.5);
+		Y[i] = (long long)floor(screenCoords[i].y * (double)SUBPIXEL_SCALE + 0.5);
+		snapped[i] = screenCoords[i];
+		snapped[i].x = (float)X[i] / SUBPIXEL_SCALE - 0.5f;
+		snapped[i].y = (float)Y[i] / SUBPIXEL_SCALE - 0.5f;
+	}
+
+	// Find bounding box of the covered pixel centers, or of the covered samples around them
+	long long minX = std::min(X[0], std::min(X[1], X[2]));
+	long long minY = std::min(Y[0], std::min(Y[1], Y[2]));
+	long long maxX = std::max(X[0], std::max(X[1], X[2]));
+	long long maxY = std::max(Y[0], std::max(Y[1], Y[2]));
+	const long long half = SUBPIXEL_SCALE / 2;
+	const long long margin = multisample ? MSAA_EXTENT : 0;
+	setup.xMin = (int)std::max(0LL, (minX - half - margin + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS);
+	setup.yMin = (int)std::max(0LL, (minY - half - margin + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS);
+	setup.xMax = (int)std::min((long long)w - 1, (maxX - half + margin) >> SUBPIXEL_BITS);
+	setup.yMax = (int)std::min((long long)h - 1, (maxY - half + margin) >> SUBPIXEL_BITS);
+	if (setup.xMin > setup.xMax || setup.yMin > setup.yMax)
+		return false;
+
+	// Exact integer edge functions decide coverage, oriented to be positive inside
+	long long area2 = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+	if (area2 == 0)
+		return false;
+	setup.edges[0] = fixedEdge(X[1], Y[1], X[2], Y[2], area2 < 0);
+	setup.edges[1] = fixedEdge(X[2], Y[2], X[0], Y[0], area2 < 0);
+	setup.edges[2] = fixedEdge(X[0], Y[0], X[1], Y[1], area2 < 0);
+
+	// Alpha and beta as float edge equations through the snapped vertices, to set up the attributes
+	float area = (float)((double)area2 / (SUBPIXEL_SCALE * SUBPIXEL_SCALE));
+	Plane alphaEdge = edgeEquation(snapped[1], snapped[2], area);
+	Plane betaEdge = edgeEquation(snapped[2], snapped[0], area);
+
+	// Attribute plane equations, stepped alongside the edges
+	setup.zPlane = attributePlane(snapped[0].z, snapped[1].z, snapped[2].z, alphaEdge, betaEdge);
+	setup.wPlane = attributePlane(wInv[0], wInv[1], wInv[2], alphaEdge, betaEdge);
+	setup.uPlane = attributePlane(Qsca[0].x, Qsca[1].x, Qsca[2].x, alphaEdge, betaEdge);
+	setup.vPlane = attributePlane(Qsca[0].y, Qsca[1].y, Qsca[2].y, alphaEdge, betaEdge);
+	setup.rPlane = attributePlane(vertices[0].color.x, vertices[1].color.x, vertices[2].color.x, alphaEdge, betaEdge);
+	setup.gPlane = attributePlane(vertices[0].color.y, vertices[1].color.y, vertices[2].color.y, alphaEdge, betaEdge);
+	setup.bPlane = attributePlane(vertices[0].color.z, vertices[1].color.z, vertices[2].color.z, alphaEdge, betaEdge);
+	setup.zMin = std::min(snapped[0].z, std::min(snapped[1].z, snapped[2].z));
+	setup.zMax = std::max(snapped[0].z, std::max(snapped[1].z, snapped[2].z));
+	return true;
+}
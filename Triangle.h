@@ -2,10 +2,106 @@
 
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <vector>
+#include <algorithm>
 
 #include <glm/glm.hpp>
 
+#include "MipPyramid.h"
+
+// Screen-space linear function f(x, y) = dx * x + dy * y + c
+struct Plane {
+	float dx, dy, c;
+
+	float at(float x, float y) const { return dx * x + dy * y + c; }
+};
+
+#define SUBPIXEL_BITS 8						// 24.8 fixed-point vertex positions
+#define SUBPIXEL_SCALE (1 << SUBPIXEL_BITS)
+#define MAX_SCREEN_COORD (1 << 22)				// Larger coordinates would overflow the edge functions
+
+// Edge function over 24.8 fixed-point positions, stepped per pixel: e(x, y) = dx * x + dy * y + c at the
+// center of pixel (x, y). Pixels with e >= 0 are covered; the top-left fill rule is folded into c.
+struct FixedEdge {
+	long long dx, dy, c;
+
+	long long at(int x, int y) const { return dx * x + dy * y + c; }
+};
+
+#define GUARD_BAND 8.0f			// Clip x and y at +-8 w: the viewport plus a wide band that needs no clipping
+#define CLIP_PLANES 5			// Near plane and the four guard band planes
+#define CULL_PLANES 10			// Clip planes, then the far plane and the four frustum sides, which only cull
+#define MAX_CLIP_VERTICES (3 + CLIP_PLANES)
+#define MAX_CLIPPED_TRIANGLES (MAX_CLIP_VERTICES - 2)
+
+// Clip-space vertex and the attributes interpolated when an edge is clipped
+struct ClipVertex {
+	glm::vec4 position;
+	glm::vec2 texCoord;
+	glm::vec3 color;
+};
+
+// Vertex position transformed to clip space once per frame, shared by every triangle using it
+struct TransformedVertex {
+	glm::vec4 position;
+	int code;				// Bit i is set when the vertex is outside plane i
+};
+
+// Triangle transformed to clip space that survived culling
+struct ClipTriangle {
+	ClipVertex vertices[3];
+	int codes[3];			// Bit i is set when the vertex is outside plane i
+};
+
+// Per-frame screen-space data of a triangle, shared by every tile it overlaps
+struct TriangleSetup {
+	FixedEdge edges[3];					// Edges opposite each vertex
+	Plane zPlane, wPlane, uPlane, vPlane;	// Depth, 1/w, u/w and v/w, at pixel centers
+	Plane rPlane, gPlane, bPlane;		// Vertex color
+	int xMin, yMin, xMax, yMax;			// Bounding box clamped to the screen
+	float zMin, zMax;					// Depth range, for Hi-Z rejection
+};
+
+// Texturing state shared by every triangle of a CPU frame
+struct Shading {
+	bool isTextured;
+	int textureMode;				// 0: nearest, 1: bilinear, 2: mipmap
+	MipPyramid* texture;
+	int tw, th;						// Size of level 0
+};
+
+// What a span computes per pixel, a compile-time parameter of the span functions
+enum ShadingMode { SHADE_COLOR, SHADE_NEAREST, SHADE_BILINEAR, SHADE_MIPMAP, SHADING_MODES };
+
+// Shading mode of a frame: interpolated vertex color, or one of the texture filters
+inline ShadingMode GetShadingMode(Shading& shading) {
+	if (!shading.isTextured) { return SHADE_COLOR; }
+	if (shading.textureMode == 0) { return SHADE_NEAREST; }
+	if (shading.textureMode == 1) { return SHADE_BILINEAR; }
+	return SHADE_MIPMAP;
+}
+
+// Rasterizes pixels xStart..xEnd of rows y..y + rows - 1 (rows is 1 or 2; a pair of rows forms a line of 2x2 quads)
+// into planar color r, g, b and depth z, which point at pixel (xStart, y); the next row is stride floats further.
+// inside is set when every pixel of the span is known to be covered, so the coverage test can be skipped.
+typedef void (*SpanFunction)(TriangleSetup& setup, Shading& shading, int y, int rows, int xStart, int xEnd, float* r, float* g, float* b, float* z, int stride, bool inside);
+
+// Visibility buffer counterpart: depth tests the same pixels and writes depth z and the triangle's id
+// where it is nearest, without shading
+typedef void (*VisibilityFunction)(TriangleSetup& setup, int y, int rows, int xStart, int xEnd, float* z, int* ids, int stride, int id, bool inside);
+
+// How a block of pixels relates to a triangle
+enum Coverage { OUTSIDE, PARTIAL, INSIDE };
+
+#define COARSE_BLOCK 16	// Blocks classified first
+#define FINE_BLOCK 4	// Sub-blocks of partially covered coarse blocks
+
+#define MSAA_SAMPLES 4		// Samples per pixel when multisampling
+#define MSAA_EXTENT 96		// Farthest a sample lies from its pixel center along x or y, in subpixels
+
+// Sample offsets from the pixel center in subpixels (1/256 pixel): the rotated grid of the standard 4x pattern
+static const int msaaOffsets[MSAA_SAMPLES][2] = { { -32, -96 }, { 96, -32 }, { -96, 32 }, { 32, 96 } };
 
 class Triangle {
 private:
@@ -13,6 +109,9 @@ private:
 	glm::vec3 c[3];		// Vertex color
 	glm::vec2 t[3];		// Texture coordinates
 
+	// Screen-space setup of a triangle already clipped to the near plane and the guard band
+	static bool SetupClipped(ClipVertex vertices[3], int h, int w, bool multisample, TriangleSetup& setup);
+
 public:
 
 	// Default constructor
@@ -27,112 +126,311 @@ public:
 	// Rendering the triangle using OpenGL
 	void RenderOpenGL(glm::mat4& modelViewMatrix, glm::mat4& projectionMatrix, bool textureMode);
 
-	// Rendering the triangle using CPU
-	template <int rows, int cols, int colors>
-	void RenderCPU(glm::mat4& modelViewMatrix, glm::mat4& projectionMatrix, float(&cBuffer)[rows][cols][colors], float(&zBuffer)[rows][cols], int h, int w, bool isTextured, int textureMode, std::vector<float*> texture, int tw, int th)
+	// Assemble the triangle from its transformed vertices, found at index[0..2] in transformed. Returns false
+	// when it lies outside the view frustum, or faces away from the camera and cullBackFaces is set.
+	bool AssembleCPU(const TransformedVertex* transformed, const int* index, bool cullBackFaces, ClipTriangle& out);
+
+	// Bit i is set when the clip-space position is outside plane i (see CULL_PLANES)
+	static int outcode(glm::vec4& p);
+
+	// Clip a transformed triangle, then set up the edge and attribute equations of each resulting triangle
+	// for the CPU rasterizer. setups must hold MAX_CLIPPED_TRIANGLES; returns how many were set up. With
+	// multisample set, bounding boxes take in every pixel with a covered sample rather than a covered center.
+	static int SetupCPU(ClipTriangle& triangle, int h, int w, bool multisample, TriangleSetup* setups);
+
+	// Rasterize the part of a set up triangle that covers the tile whose top left pixel is (x0, y0).
+	// span(setup, y, rows, xStart, xEnd, inside) draws one row, or a pair of rows starting on an even row, into
+	// the tile; it shades them, or only records visibility. Coarse blocks are rejected or accepted whole; partially covered ones are split into
+	// fine blocks, and only the partially covered fine blocks pay for the per-pixel coverage test.
+	// hiZ holds an upper bound of the depth in each coarse block, recomputed from zBuffer when hiZDirty is set;
+	// blocks (and whole triangles) behind it are skipped. zBuffer holds samples depths per pixel, side by side;
+	// with more than one, blocks are classified by the coverage of their samples rather than their centers.
+	template <int samples, int rows, int sampleCols, class Span>
+	static void RenderCPU(TriangleSetup& setup, float(&zBuffer)[rows][sampleCols],
+		float(&hiZ)[rows / COARSE_BLOCK][sampleCols / samples / COARSE_BLOCK], bool(&hiZDirty)[rows / COARSE_BLOCK][sampleCols / samples / COARSE_BLOCK],
+		int x0, int y0, Span& span)
 	{
-		// Convert verticies to NDC then to screen space
-		glm::vec4 hCoords[3];
-		glm::vec4 ndc[3];
-		float zInv[4];	// Perspective correct interpolation
-		glm::vec2 Qsca[4];
-		glm::vec4 screenCoords[3];	// Vertex coords in screenspace
-
-		glm::mat4 viewport(0.0f);
-		viewport[0][0] = w / 2;
-		viewport[1][1] = h / 2;
-		viewport[2][2] = 1;
-		viewport[3][0] = w / 2;
-		viewport[3][1] = h / 2;
-		viewport[3][3] = 1;
+		const int cols = sampleCols / samples;
+		const long long margin = samples > 1 ? MSAA_EXTENT : 0;
+		int xMin = std::max(setup.xMin, x0);
+		int yMin = std::max(setup.yMin, y0);
+		int xMax = std::min(setup.xMax, x0 + cols - 1);
+		int yMax = std::min(setup.yMax, y0 + rows - 1);
 
-		for (int i = 0; i < 3; i++) {
-			hCoords[i] = { v[i].x, v[i].y, v[i].z, 1 };
-			ndc[i] = (projectionMatrix * modelViewMatrix * hCoords[i]);
-			zInv[i] = 1 / ndc[i].z;
-			Qsca[i] = t[i] * zInv[i];
-			ndc[i] /= ndc[i].w;
-			screenCoords[i] = viewport * ndc[i];
+		// Hi-Z: find the coarse blocks where the triangle can be in front of what is already drawn
+		int bx0 = (xMin - x0) / COARSE_BLOCK, bx1 = (xMax - x0) / COARSE_BLOCK;
+		int by0 = (yMin - y0) / COARSE_BLOCK, by1 = (yMax - y0) / COARSE_BLOCK;
+		bool visible[rows / COARSE_BLOCK][cols / COARSE_BLOCK];
+		bool anyVisible = false;
+		for (int j = by0; j <= by1; j++) {
+			for (int i = bx0; i <= bx1; i++) {
+				if (hiZDirty[j][i]) {
+					hiZ[j][i] = blockMaxDepth<samples>(zBuffer, i * COARSE_BLOCK, j * COARSE_BLOCK);
+					hiZDirty[j][i] = false;
+				}
+				visible[j][i] = nearestDepth(setup, x0 + i * COARSE_BLOCK, y0 + j * COARSE_BLOCK, COARSE_BLOCK, margin) < hiZ[j][i];
+				anyVisible = anyVisible || visible[j][i];
+			}
 		}
+		if (!anyVisible) { return; }
 
-		// Find bounding box
-		glm::vec2 max = { screenCoords[0].x, screenCoords[0].y };
-		glm::vec2 min = { screenCoords[0].x, screenCoords[0].y };
-		for (int i = 0; i < 3; i++) {
-			if (screenCoords[i].x > max.x) { max.x = screenCoords[i].x; }
-			if (screenCoords[i].y > max.y) { max.y = screenCoords[i].y; }
-			if (screenCoords[i].x < min.x) { min.x = screenCoords[i].x; }
-			if (screenCoords[i].y < min.y) { min.y = screenCoords[i].y; }
+		// Draw pixels xStart..xEnd of rows yStart..yEnd, clipped to the bounding box, in pairs of rows aligned
+		// to even rows so that the span functions work on 2x2 quads
+		auto drawSpans = [&](int yStart, int yEnd, int xStart, int xEnd, bool inside) {
+			xStart = std::max(xStart, xMin);
+			xEnd = std::min(xEnd, xMax);
+			if (xStart > xEnd) { return; }
+			for (int y = yStart; y <= yEnd;) {
+				int pair = (y % 2 == 0 && y < yEnd) ? 2 : 1;
+				span(setup, y, pair, xStart, xEnd, inside);
+				y += pair;
+			}
+		};
+
+		// Small triangles gain nothing from the hierarchy
+		if (setup.xMax - setup.xMin < COARSE_BLOCK && setup.yMax - setup.yMin < COARSE_BLOCK) {
+			drawSpans(yMin, yMax, xMin, xMax, false);
+			for (int j = by0; j <= by1; j++)
+				for (int i = bx0; i <= bx1; i++)
+					hiZDirty[j][i] = true;
+			return;
 		}
-		if (max.x > w) { max.x = w; }
-		if (min.x < 0) { min.x = 0; }
-		if (max.y > h) { max.y = h; }
-		if (min.y < 0) { min.y = 0; }
-
-		// Rasterize and color
-		for (int y = min.y; y <= max.y; y++) {
-			for (int x = min.x; x <= max.x; x++) {
-				glm::vec3 abg = barycentric(x, y, screenCoords);
-				float alpha = abg.x;
-				float beta = abg.y;
-				float gamma = abg.z;
-
-				// Check inside triangle
-				if ((0 <= alpha && alpha <= 1) && (0 <= beta && beta <= 1) && (alpha + beta <= 1)) {
-					float z = (alpha * screenCoords[0] + beta * screenCoords[1] + gamma * screenCoords[2]).z;
-					glm::vec2 textureCoords = perspectiveInterpolation(glm::vec2{ x, y }, screenCoords, zInv, Qsca);
-					textureCoords.x *= tw;	//Scaling
-					textureCoords.y *= th;
-
-					// Check depth buffer
-					if ((z < zBuffer[y][x]) && (0 <= x && x < w) && (0 <= y && y < h)) {
-						glm::vec3 buff;
-						
-						// Not textured
-						if (!isTextured) {
-							buff = alpha * c[0] + beta * c[1] + gamma * c[2];
-						}
-						// Nearest neighbor
-						else if (textureMode == 0) {
-							textureCoords.x = wrap(textureCoords.x, tw);
-							textureCoords.y = wrap(textureCoords.y, th);
-							buff = getTexColor(floor(textureCoords.x), floor(textureCoords.y), tw, texture, 0);
-						}
-						// Bilinear Interpolation
-						else if (textureMode == 1) {
-							textureCoords.x = wrap(textureCoords.x, tw);
-							textureCoords.y = wrap(textureCoords.y, th);
-							buff = bilinear(textureCoords, tw, texture, 0);
-						}
-						// Mipmapping
-						else if (textureMode == 2) {
-							glm::vec2 rightTexCoords = perspectiveInterpolation(glm::vec2{ x + 1, y }, screenCoords, zInv, Qsca);
-							rightTexCoords.x *= tw;	//Scaling
-							rightTexCoords.y *= th;
-							glm::vec2 rightDistance = rightTexCoords - textureCoords;	// du, dv
-							glm::vec2 upTexCoords = perspectiveInterpolation(glm::vec2{ x, y + 1 }, screenCoords, zInv, Qsca);
-							upTexCoords.x *= tw;	//Scaling
-							upTexCoords.y *= th;
-							glm::vec2 upDistance = upTexCoords - textureCoords;
-							float L = findMax(sqrt(pow(rightDistance.x, 2) + pow(rightDistance.y, 2)), sqrt(pow(upDistance.x, 2) + pow(upDistance.y, 2)));
-							float D = clamp(log2(L), 0, 10);
-							//std::cout << "D: " << D << std::endl;
-
-							textureCoords.x = wrap(textureCoords.x, tw);
-							textureCoords.y = wrap(textureCoords.y, th);
-							glm::vec3 c1 = bilinear(textureCoords, tw, texture, floor(D));
-							glm::vec3 c2 = bilinear(textureCoords, tw, texture, ceil(D));
-							buff = lerp(D - floor(D), c1, c2);
-							//buff = glm::vec3{ 0, D/10, 0};
-						}
-
-						cBuffer[y][x][0] = buff.x;
-						cBuffer[y][x][1] = buff.y;
-						cBuffer[y][x][2] = buff.z;
-						zBuffer[y][x] = z;
+
+		// Rasterize and color, one band of coarse blocks (aligned to the tile) at a time
+		const int fineBlocks = cols / FINE_BLOCK;
+		const int finePerCoarse = COARSE_BLOCK / FINE_BLOCK;
+		int bxStart = (xMin - x0) / COARSE_BLOCK * COARSE_BLOCK;
+		int byStart = (yMin - y0) / COARSE_BLOCK * COARSE_BLOCK;
+		for (int by = y0 + byStart; by <= yMax; by += COARSE_BLOCK) {
+			Coverage coarse[cols / COARSE_BLOCK];
+			bool any = false;
+			int j = (by - y0) / COARSE_BLOCK;
+			for (int bx = x0 + bxStart; bx <= xMax; bx += COARSE_BLOCK) {
+				int i = (bx - x0) / COARSE_BLOCK;
+				coarse[i] = visible[j][i] ? classifyBlock(setup, bx, by, COARSE_BLOCK, margin) : OUTSIDE;
+				any = any || coarse[i] != OUTSIDE;
+			}
+			if (!any) { continue; }
+
+			for (int fby = by; fby < by + COARSE_BLOCK && fby <= yMax; fby += FINE_BLOCK) {
+				// Fine blocks inherit the class of an inside or outside coarse block; partial ones are refined
+				Coverage fine[fineBlocks];
+				int first = fineBlocks, last = -1;
+				for (int fx = bxStart / FINE_BLOCK; fx * FINE_BLOCK + x0 <= xMax; fx++) {
+					Coverage parent = coarse[fx / finePerCoarse];
+					fine[fx] = parent == PARTIAL ? classifyBlock(setup, x0 + fx * FINE_BLOCK, fby, FINE_BLOCK, margin) : parent;
+					if (fine[fx] != OUTSIDE) {
+						first = std::min(first, fx);
+						last = fx;
 					}
 				}
+
+				// The covered fine blocks of a band are contiguous: draw them as runs of inside and partial blocks
+				for (int fx = first; fx <= last;) {
+					bool inside = fine[fx] == INSIDE;
+					int run = fx + 1;
+					while (run <= last && (fine[run] == INSIDE) == inside) { run++; }
+					drawSpans(std::max(fby, yMin), std::min(fby + FINE_BLOCK - 1, yMax), x0 + fx * FINE_BLOCK, x0 + run * FINE_BLOCK - 1, inside);
+					fx = run;
+				}
+			}
+
+			// Covered blocks now hold nothing farther than the triangle; partial ones are recomputed when next needed
+			for (int bx = x0 + bxStart; bx <= xMax; bx += COARSE_BLOCK) {
+				int i = (bx - x0) / COARSE_BLOCK;
+				if (coarse[i] == INSIDE) { hiZ[j][i] = std::min(hiZ[j][i], farthestDepth(setup, bx, by, COARSE_BLOCK, margin)); }
+				else if (coarse[i] == PARTIAL) { hiZDirty[j][i] = true; }
+			}
+		}
+	}
+
+	// Scalar span function: one row at a time. Each shading mode is its own instantiation,
+	// so the pixel loop does not branch on it.
+	template <ShadingMode mode>
+	static void ShadeSpan(TriangleSetup& setup, Shading& shading, int y, int rows, int xStart, int xEnd, float* r, float* g, float* b, float* z, int stride, bool inside)
+	{
+		for (int row = 0; row < rows; row++)
+			ShadeRow<mode>(setup, shading, y + row, xStart, xEnd, r + row * stride, g + row * stride, b + row * stride, z + row * stride, inside);
+	}
+
+	// Rasterize pixels xStart..xEnd of row y. r, g, b and z point at pixel xStart.
+	template <ShadingMode mode>
+	static void ShadeRow(TriangleSetup& setup, Shading& shading, int y, int xStart, int xEnd, float* r, float* g, float* b, float* z, bool inside)
+	{
+		long long e0 = setup.edges[0].at(xStart, y);
+		long long e1 = setup.edges[1].at(xStart, y);
+		long long e2 = setup.edges[2].at(xStart, y);
+		float depth = setup.zPlane.at(xStart, y);
+		glm::vec3 Qsw = { setup.uPlane.at(xStart, y), setup.vPlane.at(xStart, y), setup.wPlane.at(xStart, y) };
+		glm::vec3 rgb = { setup.rPlane.at(xStart, y), setup.gPlane.at(xStart, y), setup.bPlane.at(xStart, y) };
+		glm::vec3 dQswdx = { setup.uPlane.dx, setup.vPlane.dx, setup.wPlane.dx };
+		glm::vec3 dQswdy = { setup.uPlane.dy, setup.vPlane.dy, setup.wPlane.dy };
+		glm::vec3 drgbdx = { setup.rPlane.dx, setup.gPlane.dx, setup.bPlane.dx };
+
+		for (int i = 0; i <= xEnd - xStart; i++) {
+			// Check inside triangle
+			if (inside || (e0 | e1 | e2) >= 0) {
+				// Check depth buffer
+				if (depth < z[i]) {
+					glm::vec3 buff = shadePixel<mode>(shading, Qsw, rgb, dQswdx, dQswdy);
+
+					r[i] = buff.x;
+					g[i] = buff.y;
+					b[i] = buff.z;
+					z[i] = depth;
+				}
+			}
+
+			// Step to the next pixel
+			e0 += setup.edges[0].dx;
+			e1 += setup.edges[1].dx;
+			e2 += setup.edges[2].dx;
+			depth += setup.zPlane.dx;
+			if (mode == SHADE_COLOR) { rgb += drgbdx; }
+			else { Qsw += dQswdx; }
+		}
+	}
+
+	// Color of a covered pixel, from its interpolated (u/w, v/w, 1/w) or vertex color
+	template <ShadingMode mode>
+	static glm::vec3 shadePixel(Shading& shading, glm::vec3& Qsw, glm::vec3& rgb, glm::vec3& dQswdx, glm::vec3& dQswdy)
+	{
+		glm::vec3 buff;
+		glm::vec2 textureCoords;
+		if (mode != SHADE_COLOR) { textureCoords = perspectiveDivide(Qsw, shading.tw, shading.th); }
+
+		// Not textured
+		if (mode == SHADE_COLOR) {
+			buff = rgb;
+		}
+		// Nearest neighbor
+		else if (mode == SHADE_NEAREST) {
+			textureCoords.x = wrap(textureCoords.x, shading.tw);
+			textureCoords.y = wrap(textureCoords.y, shading.th);
+			buff = getTexColor((int)textureCoords.x, (int)textureCoords.y, shading.texture->Level(0), shading.tw);
+		}
+		// Bilinear Interpolation
+		else if (mode == SHADE_BILINEAR) {
+			textureCoords.x = wrap(textureCoords.x, shading.tw);
+			textureCoords.y = wrap(textureCoords.y, shading.th);
+			buff = bilinear(textureCoords, shading.texture->Level(0), shading.tw, shading.th);
+		}
+		// Mipmapping
+		else {
+			MipPyramid& texture = *shading.texture;
+			float D = mipLevel(textureCoords, 1 / Qsw.z, dQswdx, dQswdy, shading.tw, shading.th, texture.levels);
+			int lower = (int)D;
+			int upper = std::min(lower + 1, texture.levels - 1);
+			glm::vec3 c1 = sampleLevel(textureCoords, texture, lower);
+			glm::vec3 c2 = sampleLevel(textureCoords, texture, upper);
+			buff = lerp(D - lower, c1, c2);
+		}
+		return buff;
+	}
+
+	// Multisampled span function: one row at a time. r, g, b and z point at the first sample of pixel (xStart, y),
+	// and the MSAA_SAMPLES samples of each pixel are side by side. Coverage and depth are tested per sample,
+	// but each pixel is shaded only once for all of its samples that pass: at its center, or at a covered
+	// sample when the center is outside the triangle (centroid sampling), so attributes never extrapolate.
+	template <ShadingMode mode>
+	static void ShadeSpanMultisample(TriangleSetup& setup, Shading& shading, int y, int rows, int xStart, int xEnd, float* r, float* g, float* b, float* z, int stride, bool inside)
+	{
+		for (int row = 0; row < rows; row++)
+			ShadeRowMultisample<mode>(setup, shading, y + row, xStart, xEnd, r + row * stride, g + row * stride, b + row * stride, z + row * stride, inside);
+	}
+
+	template <ShadingMode mode>
+	static void ShadeRowMultisample(TriangleSetup& setup, Shading& shading, int y, int xStart, int xEnd, float* r, float* g, float* b, float* z, bool inside)
+	{
+		// Edge and depth offsets of each sample from its pixel center. The edge steps are whole multiples of
+		// SUBPIXEL_SCALE, so the edge offsets stay exact.
+		long long edgeOffsets[3][MSAA_SAMPLES];
+		float depthOffsets[MSAA_SAMPLES];
+		for (int s = 0; s < MSAA_SAMPLES; s++) {
+			for (int k = 0; k < 3; k++)
+				edgeOffsets[k][s] = (setup.edges[k].dx * msaaOffsets[s][0] + setup.edges[k].dy * msaaOffsets[s][1]) / SUBPIXEL_SCALE;
+			depthOffsets[s] = (setup.zPlane.dx * msaaOffsets[s][0] + setup.zPlane.dy * msaaOffsets[s][1]) / SUBPIXEL_SCALE;
+		}
+
+		long long e0 = setup.edges[0].at(xStart, y);
+		long long e1 = setup.edges[1].at(xStart, y);
+		long long e2 = setup.edges[2].at(xStart, y);
+		float depth = setup.zPlane.at(xStart, y);
+		glm::vec3 Qsw = { setup.uPlane.at(xStart, y), setup.vPlane.at(xStart, y), setup.wPlane.at(xStart, y) };
+		glm::vec3 rgb = { setup.rPlane.at(xStart, y), setup.gPlane.at(xStart, y), setup.bPlane.at(xStart, y) };
+		glm::vec3 dQswdx = { setup.uPlane.dx, setup.vPlane.dx, setup.wPlane.dx };
+		glm::vec3 dQswdy = { setup.uPlane.dy, setup.vPlane.dy, setup.wPlane.dy };
+		glm::vec3 drgbdx = { setup.rPlane.dx, setup.gPlane.dx, setup.bPlane.dx };
+		glm::vec3 drgbdy = { setup.rPlane.dy, setup.gPlane.dy, setup.bPlane.dy };
+
+		for (int i = 0; i <= xEnd - xStart; i++) {
+			// Coverage mask of the samples inside the triangle and in front of the depth buffer
+			float* sampleZ = &z[i * MSAA_SAMPLES];
+			int mask = 0;
+			for (int s = 0; s < MSAA_SAMPLES; s++) {
+				bool covered = inside || ((e0 + edgeOffsets[0][s]) | (e1 + edgeOffsets[1][s]) | (e2 + edgeOffsets[2][s])) >= 0;
+				if (covered && depth + depthOffsets[s] < sampleZ[s]) { mask |= 1 << s; }
+			}
+
+			if (mask) {
+				glm::vec3 buff;
+				if (inside || (e0 | e1 | e2) >= 0) {
+					buff = shadePixel<mode>(shading, Qsw, rgb, dQswdx, dQswdy);
+				}
+				else {
+					int s = 0;
+					while (!(mask & (1 << s))) { s++; }
+					float ox = (float)msaaOffsets[s][0] / SUBPIXEL_SCALE;
+					float oy = (float)msaaOffsets[s][1] / SUBPIXEL_SCALE;
+					glm::vec3 sampleQsw = Qsw + dQswdx * ox + dQswdy * oy;
+					glm::vec3 sampleRgb = rgb + drgbdx * ox + drgbdy * oy;
+					buff = shadePixel<mode>(shading, sampleQsw, sampleRgb, dQswdx, dQswdy);
+				}
+				for (int s = 0; s < MSAA_SAMPLES; s++) {
+					if (!(mask & (1 << s))) { continue; }
+					r[i * MSAA_SAMPLES + s] = buff.x;
+					g[i * MSAA_SAMPLES + s] = buff.y;
+					b[i * MSAA_SAMPLES + s] = buff.z;
+					sampleZ[s] = depth + depthOffsets[s];
+				}
 			}
+
+			// Step to the next pixel
+			e0 += setup.edges[0].dx;
+			e1 += setup.edges[1].dx;
+			e2 += setup.edges[2].dx;
+			depth += setup.zPlane.dx;
+			if (mode == SHADE_COLOR) { rgb += drgbdx; }
+			else { Qsw += dQswdx; }
+		}
+	}
+
+	// Scalar visibility function, one row at a time
+	static void VisibilitySpan(TriangleSetup& setup, int y, int rows, int xStart, int xEnd, float* z, int* ids, int stride, int id, bool inside)
+	{
+		for (int row = 0; row < rows; row++)
+			VisibilityRow(setup, y + row, xStart, xEnd, z + row * stride, ids + row * stride, id, inside);
+	}
+
+	// Depth test pixels xStart..xEnd of row y, writing depth and id. z and ids point at pixel xStart.
+	static void VisibilityRow(TriangleSetup& setup, int y, int xStart, int xEnd, float* z, int* ids, int id, bool inside)
+	{
+		long long e0 = setup.edges[0].at(xStart, y);
+		long long e1 = setup.edges[1].at(xStart, y);
+		long long e2 = setup.edges[2].at(xStart, y);
+		float depth = setup.zPlane.at(xStart, y);
+
+		for (int i = 0; i <= xEnd - xStart; i++) {
+			if ((inside || (e0 | e1 | e2) >= 0) && depth < z[i]) {
+				z[i] = depth;
+				ids[i] = id;
+			}
+
+			// Step to the next pixel
+			e0 += setup.edges[0].dx;
+			e1 += setup.edges[1].dx;
+			e2 += setup.edges[2].dx;
+			depth += setup.zPlane.dx;
 		}
 	}
 
@@ -141,65 +439,173 @@ public:
 	glm::vec3* getVertColors(int i) { return &c[i]; }
 	void setVertColor(glm::vec3* vc, int i) { c[i] = *vc; }
 
-	// Map texture coordinates to [0, 1]
-	float wrap(float coord, int max) {
+	// Wrap texel coordinates into [0, max)
+	static float wrap(float coord, int max) {
 		while (coord < 0) { coord += max; }
-		while (coord > max) { coord -= max; }
+		while (coord >= max) { coord -= max; }
 		return coord;
 	}
 
-	// Clamp value to a given range
-	float clamp(float val, float lower, float upper) {
-		if (val < lower) { return lower; }
+	// Clamp value to a given range. NaN maps to lower, so it can't turn into a wild mip level.
+	static float clamp(float val, float lower, float upper) {
+		if (!(val >= lower)) { return lower; }
 		else if (val > upper) { return upper; }
 		return val;
 	}
 
-	// Get texture color given screen coordinates
-	glm::vec3 getTexColor(float x, float y, float tw, std::vector<float*> texture, int i) {
+	// Texel (x, y) of a texture level width texels wide
+	static glm::vec3 getTexColor(int x, int y, const float* texels, int width) {
 		glm::vec3 ret;
-		int ind = 3 * (x + y * tw);
-		ret.x = texture[i][ind];
-		ret.y = texture[i][ind + 1];
-		ret.z = texture[i][ind + 2];
+		size_t ind = 3 * (x + (size_t)y * width);
+		ret.x = texels[ind];
+		ret.y = texels[ind + 1];
+		ret.z = texels[ind + 2];
 		return ret;
 	}
 
 	// Linear interpolation
-	glm::vec3 lerp(float x, glm::vec3 v0, glm::vec3 v1) { return v0 + x * (v1 - v0); }
-
-	// Bilinear interpolation
-	glm::vec3 bilinear(glm::vec2 texCoords, int tw, std::vector<float*> texture, int i) {
-		glm::vec3 u00 = getTexColor(floor(texCoords.x), floor(texCoords.y), tw, texture, i);
-		glm::vec3 u01 = getTexColor(floor(texCoords.x), ceil(texCoords.y), tw, texture, i);
-		glm::vec3 u10 = getTexColor(ceil(texCoords.x), floor(texCoords.y), tw, texture, i);
-		glm::vec3 u11 = getTexColor(ceil(texCoords.x), ceil(texCoords.y), tw, texture, i);
-
-		glm::vec3 u0 = lerp(texCoords.x - floor(texCoords.x), u00, u10);
-		glm::vec3 u1 = lerp(texCoords.x - floor(texCoords.x), u01, u11);
-		glm::vec3 u = lerp(texCoords.y - floor(texCoords.y), u0, u1);
+	static glm::vec3 lerp(float x, glm::vec3 v0, glm::vec3 v1) { return v0 + x * (v1 - v0); }
+
+	// Bilinear interpolation at wrapped texel coordinates of a width x height level. Taps past the last
+	// column or row wrap around to the first.
+	static glm::vec3 bilinear(glm::vec2 texCoords, const float* texels, int width, int height) {
+		int x0 = (int)texCoords.x, y0 = (int)texCoords.y;
+		int x1 = x0 + 1 < width ? x0 + 1 : 0;
+		int y1 = y0 + 1 < height ? y0 + 1 : 0;
+		glm::vec3 u00 = getTexColor(x0, y0, texels, width);
+		glm::vec3 u01 = getTexColor(x0, y1, texels, width);
+		glm::vec3 u10 = getTexColor(x1, y0, texels, width);
+		glm::vec3 u11 = getTexColor(x1, y1, texels, width);
+
+		glm::vec3 u0 = lerp(texCoords.x - x0, u00, u10);
+		glm::vec3 u1 = lerp(texCoords.x - x0, u01, u11);
+		glm::vec3 u = lerp(texCoords.y - y0, u0, u1);
 		return u;
 	}
 
-	// Calculate alpha, beta, gamma given coordinates
-	glm::vec3 barycentric(int x, int y, glm::vec4 coords[3]) {
-		float alpha = (-(x - coords[1].x) * (coords[2].y - coords[1].y) + (y - coords[1].y) * (coords[2].x - coords[1].x)) / (-(coords[0].x - coords[1].x) * (coords[2].y - coords[1].y) + (coords[0].y - coords[1].y) * (coords[2].x - coords[1].x));
-		float beta = (-(x - coords[2].x) * (coords[0].y - coords[2].y) + (y - coords[2].y) * (coords[0].x - coords[2].x)) / (-(coords[1].x - coords[2].x) * (coords[0].y - coords[2].y) + (coords[1].y - coords[2].y) * (coords[0].x - coords[2].x));
-		float gamma = 1 - alpha - beta;
-		return glm::vec3{ alpha, beta, gamma };
+	// Bilinear sample of mip level i at texel coordinates of level 0. Texel k of a level sits at coordinate k,
+	// so a texel of level i sits at the center of the level 0 texels it averages.
+	static glm::vec3 sampleLevel(glm::vec2 texCoords, MipPyramid& texture, int i) {
+		glm::vec2 levelCoords;
+		levelCoords.x = wrap((texCoords.x + 0.5f) * texture.scaleX[i] - 0.5f, texture.width[i]);
+		levelCoords.y = wrap((texCoords.y + 0.5f) * texture.scaleY[i] - 0.5f, texture.height[i]);
+		return bilinear(levelCoords, texture.Level(i), texture.width[i], texture.height[i]);
+	}
+
+	// Edge equation through a and b, scaled so it is 1 at the opposite vertex
+	static Plane edgeEquation(glm::vec4 a, glm::vec4 b, float area) {
+		Plane e;
+		e.dx = -(b.y - a.y) / area;
+		e.dy = (b.x - a.x) / area;
+		e.c = (a.x * (b.y - a.y) - a.y * (b.x - a.x)) / area;
+		return e;
+	}
+
+	// Fixed-point edge function through a and b, positive on the side of a counter-clockwise triangle's
+	// interior (negated when flip is set). A pixel center exactly on the edge is only covered when the
+	// edge is a left edge or a horizontal top edge, so triangles sharing an edge never both cover it.
+	static FixedEdge fixedEdge(long long xa, long long ya, long long xb, long long yb, bool flip) {
+		long long a = ya - yb;
+		long long b = xb - xa;
+		long long c = xa * yb - xb * ya;
+		if (flip) { a = -a; b = -b; c = -c; }
+
+		FixedEdge e;
+		e.dx = a * SUBPIXEL_SCALE;
+		e.dy = b * SUBPIXEL_SCALE;
+		e.c = c + (a + b) * (SUBPIXEL_SCALE / 2);	// Center of pixel (0, 0)
+		bool topLeft = a > 0 || (a == 0 && b < 0);
+		if (!topLeft) { e.c -= 1; }
+		return e;
+	}
+
+	// Plane equation of a vertex attribute, from its values at the three vertices
+	static Plane attributePlane(float a0, float a1, float a2, Plane& alphaEdge, Plane& betaEdge) {
+		Plane p;
+		p.dx = (a0 - a2) * alphaEdge.dx + (a1 - a2) * betaEdge.dx;
+		p.dy = (a0 - a2) * alphaEdge.dy + (a1 - a2) * betaEdge.dy;
+		p.c = (a0 - a2) * alphaEdge.c + (a1 - a2) * betaEdge.c + a2;
+		return p;
+	}
+
+	// Classify the size x size block of pixels with top left pixel (x, y) against the three edges. margin widens
+	// the pixel centers by that many subpixels on every side, to classify samples around them.
+	static Coverage classifyBlock(TriangleSetup& setup, int x, int y, int size, long long margin) {
+		long long extent = size - 1;
+		bool inside = true;
+		for (int i = 0; i < 3; i++) {
+			FixedEdge& e = setup.edges[i];
+			long long corner = e.at(x, y);
+			long long spread = (llabs(e.dx) + llabs(e.dy)) / SUBPIXEL_SCALE * margin;
+			long long highest = corner + (std::max(e.dx, 0LL) + std::max(e.dy, 0LL)) * extent + spread;
+			long long lowest = corner + (std::min(e.dx, 0LL) + std::min(e.dy, 0LL)) * extent - spread;
+			if (highest < 0) { return OUTSIDE; }
+			if (lowest < 0) { inside = false; }
+		}
+		return inside ? INSIDE : PARTIAL;
+	}
+
+	// Nearest depth of the triangle over the size x size block with top left pixel (x, y), widened by margin subpixels
+	static float nearestDepth(TriangleSetup& setup, int x, int y, int size, long long margin) {
+		Plane& p = setup.zPlane;
+		float spread = (fabs(p.dx) + fabs(p.dy)) * margin / SUBPIXEL_SCALE;
+		float lowest = p.at(x, y) + (std::min(p.dx, 0.0f) + std::min(p.dy, 0.0f)) * (size - 1) - spread;
+		return std::max(lowest, setup.zMin);
+	}
+
+	// Farthest depth of the triangle over the size x size block with top left pixel (x, y), widened by margin subpixels
+	static float farthestDepth(TriangleSetup& setup, int x, int y, int size, long long margin) {
+		Plane& p = setup.zPlane;
+		float spread = (fabs(p.dx) + fabs(p.dy)) * margin / SUBPIXEL_SCALE;
+		float highest = p.at(x, y) + (std::max(p.dx, 0.0f) + std::max(p.dy, 0.0f)) * (size - 1) + spread;
+		return std::min(highest, setup.zMax);
+	}
+
+	// Farthest depth stored in the coarse block with top left pixel (x, y) of a tile depth buffer with
+	// samples depths per pixel. Column-wise maxima first, so the loop vectorizes.
+	template <int samples, int rows, int sampleCols>
+	static float blockMaxDepth(float(&zBuffer)[rows][sampleCols], int x, int y) {
+		const int width = COARSE_BLOCK * samples;
+		float column[width];
+		for (int i = 0; i < width; i++) { column[i] = zBuffer[y][x * samples + i]; }
+		for (int j = 1; j < COARSE_BLOCK; j++)
+			for (int i = 0; i < width; i++) { column[i] = std::max(column[i], zBuffer[y + j][x * samples + i]); }
+		float result = column[0];
+		for (int i = 1; i < width; i++) { result = std::max(result, column[i]); }
+		return result;
+	}
+
+	// Approximate log2 of a positive number, to about 0.005: the exponent bits, plus a quadratic fit over the mantissa
+	static float fastLog2(float x) {
+		unsigned int bits;
+		memcpy(&bits, &x, sizeof(bits));
+		float exponent = (float)((int)(bits >> 23) - 127);
+		bits = (bits & 0x007FFFFF) | 0x3F800000;
+		float mantissa;
+		memcpy(&mantissa, &bits, sizeof(mantissa));
+		return exponent + (-0.34484843f * mantissa + 2.02466578f) * mantissa - 0.67487759f;
+	}
+
+	// Mip level of a pixel with texel coordinates textureCoords and clip-space w, from the analytic derivatives of
+	// u = (u/w) / (1/w): du/dx = (d(u/w)/dx - u d(1/w)/dx) w, and likewise for v and y. dQswdx and dQswdy are the
+	// gradients of (u/w, v/w, 1/w). log2 of the longer derivative is half the log2 of its squared length.
+	static float mipLevel(glm::vec2 textureCoords, float w, glm::vec3 dQswdx, glm::vec3 dQswdy, int tw, int th, int levels) {
+		float dudx = (dQswdx.x * tw - textureCoords.x * dQswdx.z) * w;
+		float dvdx = (dQswdx.y * th - textureCoords.y * dQswdx.z) * w;
+		float dudy = (dQswdy.x * tw - textureCoords.x * dQswdy.z) * w;
+		float dvdy = (dQswdy.y * th - textureCoords.y * dQswdy.z) * w;
+		float lengthSquared = findMax(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+		return clamp(0.5f * fastLog2(lengthSquared), 0, levels - 1);
 	}
 
 	// Find maximum
-	float findMax(float a, float b) {
+	static float findMax(float a, float b) {
 		if (a > b) { return a; }
 		return b;
 	}
 
-	// Perform perspective correct interpolation on a point
-	glm::vec2 perspectiveInterpolation(glm::vec2 point, glm::vec4 screenCoords[3], float zInv[], glm::vec2 Qsca[]) {
-		glm::vec3 abg = barycentric(point.x, point.y, screenCoords);
-		float zInvPoint = abg.x * zInv[0] + abg.y * zInv[1] + abg.z * zInv[2];
-		glm::vec2 QscaPoint = abg.x * Qsca[0] + abg.y * Qsca[1] + abg.z * Qsca[2];
-		return QscaPoint / zInvPoint;
+	// Recover scaled texture coordinates from interpolated (u/w, v/w, 1/w)
+	static glm::vec2 perspectiveDivide(glm::vec3 Qsw, int tw, int th) {
+		return glm::vec2{ Qsw.x / Qsw.z * tw, Qsw.y / Qsw.z * th };
 	}
 };
\ No newline at end of file
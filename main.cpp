@@ -11,30 +11,51 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#ifdef _WIN32
+#include <direct.h>
+#define getcwd _getcwd
+#else
+#include <unistd.h>
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#include "stb_image_resize.h"
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 #include "Triangle.h"
+#include "TileRenderer.h"
+#include "FrameBuffer.h"
+#include "FramePresenter.h"
+#include "ResolutionScaler.h"
 
 
-#define WINDOW_WIDTH 1024
+#define WINDOW_WIDTH 1024		// Initial window size; the window can be resized
 #define WINDOW_HEIGHT 1024
+#define FRAME_BUDGET 16.0f		// Default CPU frame time target of dynamic resolution, in milliseconds
+#define FRAME_BUDGET_STEP 2.0f
+#define MIN_RENDER_SCALE 0.25f	// Smallest fraction of the window size dynamic resolution renders at
+#define SETTLE_TIME 0.25		// Seconds without changes after which a reduced frame is rendered again in full
 
 GLFWwindow *window;
 bool lButtonPressed;
 bool rButtonPressed;
+int windowWidth = WINDOW_WIDTH;
+int windowHeight = WINDOW_HEIGHT;
 
 
-float color[WINDOW_HEIGHT][WINDOW_WIDTH][3];
-float depth[WINDOW_HEIGHT][WINDOW_WIDTH];
+FramePresenter* framePresenter = NULL;			// Hands out CPU frames sized to the window and shows them; needs the GL context
+ColorFormat colorFormat = COLOR_RGBA8;			// RGBA8 is a quarter of the float frame to write and upload
+ResolutionScaler resolutionScaler(FRAME_BUDGET, MIN_RENDER_SCALE);
+bool dynamicResolution = false;					// CPU frames are rendered below window size to hold the frame budget
+bool fullResolution = false;					// The next CPU frame replaces a reduced one at window size
+bool reducedFrame = false;						// The last CPU frame was rendered below window size
+double frameTime = 0.0;							// When the last frame for a change was rendered
 float maxZ, minZ;
 
+TileRenderer tileRenderer;
+
 
 std::vector<Triangle> triangleVector;
-std::vector<float*> texture;
+MipPyramid texture;
 
 bool isOpenGL = true;
 bool isTextured = false;
@@ -43,21 +64,88 @@ int textureMode = 0;
 int colorMode = 0;
 float angle = 0;
 
+bool frameDirty = true;			// Scene, camera or rendering mode changed since the last frame
+bool redrawPending = false;		// The window lost its contents, but the last frame is still valid
+
 std::string mainName = "Assignment3 - Ethan Martinez";
 
 int texWidth, texHeight;
 
 GLuint texID;
 
-void ClearFrameBuffer()
+glm::mat4 ProjectionMatrix(int width, int height)
 {
-	memset(&color[0][0][0], 0.0f, sizeof(float) * WINDOW_WIDTH * WINDOW_HEIGHT * 3);
+	return glm::perspective(glm::radians(60.0f), float(width) / float(height), 0.1f, 100.0f);
+}
+
+glm::mat4 ModelViewMatrix()
+{
+	return glm::lookAt(eyeDistance * glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)) * glm::rotate(glm::mat4(1.0f), angle, glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+// Path of a file in the working directory, for messages
+std::string WorkingDirectoryPath(const std::string& fileName)
+{
+	char directory[4096];
+	if (!getcwd(directory, sizeof(directory)))
+		return fileName;
+#ifdef _WIN32
+	return std::string(directory) + "\\" + fileName;
+#else
+	return std::string(directory) + "/" + fileName;
+#endif
+}
+
+// Render a width x height frame on the CPU, independent of the window, and save it as a binary PPM in the
+// working directory. It has a renderer of its own, with the interactive one's settings, so that the
+// interactive renderer's reprojection history and buffers stay at the window size.
+void RenderOffline(int width, int height)
+{
+	TileRenderer offlineRenderer;
+	offlineRenderer.SetBackFaceCulling(tileRenderer.BackFaceCulling());
+	offlineRenderer.SetDeferred(tileRenderer.Deferred());
+	offlineRenderer.SetDepthSort(tileRenderer.DepthSort());
+	offlineRenderer.SetMultisample(tileRenderer.Multisample());
+
+	FrameBuffer frame;
+	frame.Resize(width, height, COLOR_RGBA8);
+	glm::mat4 projectionMatrix = ProjectionMatrix(width, height);
+	glm::mat4 modelViewMatrix = ModelViewMatrix();
+	offlineRenderer.Render(triangleVector, modelViewMatrix, projectionMatrix, frame, isTextured, textureMode, texture, texWidth, texHeight);
+
+	// PPM rows go from the top, the frame's from the bottom
+	std::string fileName = "frame_" + std::to_string(width) + "x" + std::to_string(height) + ".ppm";
+	std::string path = WorkingDirectoryPath(fileName);
+	std::ofstream file(fileName, std::ios::binary);
+	if (!file)
+	{
+		std::cerr << "Could not write " << path << std::endl;
+		return;
+	}
+	file << "P6\n" << width << " " << height << "\n255\n";
+	std::vector<char> row(3 * width);
+	for (int y = height - 1; y >= 0; y--)
+	{
+		unsigned char* pixels = frame.Row(y);
+		for (int x = 0; x < width; x++)
+		{
+			row[3 * x + 0] = pixels[4 * x + 0];
+			row[3 * x + 1] = pixels[4 * x + 1];
+			row[3 * x + 2] = pixels[4 * x + 2];
+		}
+		file.write(row.data(), row.size());
+	}
+	std::cout << "Saved " << path << "\n";
 }
 
 void Display()
 {	
-	glm::mat4 projectionMatrix = glm::perspective(glm::radians(60.0f), float(WINDOW_WIDTH) / float(WINDOW_HEIGHT), 0.1f, 100.0f);
-	glm::mat4 modelViewMatrix = glm::lookAt(eyeDistance * glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)) * glm::rotate(glm::mat4(1.0f), angle, glm::vec3(0.0f, 1.0f, 0.0f));
+	// Nothing to draw into while the window is minimized
+	if (windowWidth <= 0 || windowHeight <= 0)
+		return;
+
+	glm::mat4 projectionMatrix = ProjectionMatrix(windowWidth, windowHeight);
+	glm::mat4 modelViewMatrix = ModelViewMatrix();
 
 	if (isOpenGL)
 	{
@@ -72,17 +160,24 @@ void Display()
 	}
 	else
 	{
-		for (int i = 0; i < WINDOW_HEIGHT; i++) {
-			for (int j = 0; j < WINDOW_WIDTH; j++) {
-				depth[i][j] = std::numeric_limits<double>::infinity();
-			}
-		}
-		
-		for (int i = 0; i < triangleVector.size(); i++)
-			triangleVector[i].RenderCPU(modelViewMatrix, projectionMatrix, color, depth, WINDOW_HEIGHT, WINDOW_WIDTH, isTextured, textureMode, texture, texWidth, texHeight);
-
-		glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, &color[0][0][0]);
-		ClearFrameBuffer();
+		// With dynamic resolution, the frame is a fraction of the window size and is scaled up as it is shown
+		int width = windowWidth;
+		int height = windowHeight;
+		bool scaled = dynamicResolution && !fullResolution;
+		if (scaled)
+			resolutionScaler.FrameSize(windowWidth, windowHeight, width, height);
+
+		// The renderer clears tiles lazily and overwrites every pixel of the frame, so no full-buffer clear is needed
+		double start = glfwGetTime();
+		FrameBuffer& frame = framePresenter->Acquire(width, height, colorFormat);
+		tileRenderer.Render(triangleVector, modelViewMatrix, projectionMatrix, frame, isTextured, textureMode, texture, texWidth, texHeight);
+		framePresenter->Present(windowWidth, windowHeight);
+
+		// Only frames rendered while the view changes steer the scale; a full-size one after it settles may take longer
+		if (scaled)
+			resolutionScaler.Update((float)((glfwGetTime() - start) * 1000.0));
+		reducedFrame = width != windowWidth || height != windowHeight;
+		fullResolution = false;
 	}
 
 	glFlush();
@@ -140,11 +235,31 @@ void colorTriangles() {
 		}
 		break;
 	}
+
+	// The CPU renderer's last frame has the old colors
+	tileRenderer.InvalidateHistory();
+}
+
+// The window and its CPU frame follow the framebuffer size, which is 0 x 0 while minimized
+void FramebufferSizeCallback(GLFWwindow* lWindow, int width, int height)
+{
+	windowWidth = width;
+	windowHeight = height;
+	glViewport(0, 0, width, height);
+	frameDirty = true;
+}
+
+// The window was uncovered or needs its contents again for another reason; nothing in the scene changed
+void WindowRefreshCallback(GLFWwindow* lWindow)
+{
+	redrawPending = true;
 }
 
 // Keyboard character callback function
 void CharacterCallback(GLFWwindow* lWindow, unsigned int key)
 {
+	// Keys that change the scene, the camera or how the frame is rendered leave this set
+	bool changed = true;
 	switch (key) 
 	{
 	case '0':
@@ -178,8 +293,10 @@ void CharacterCallback(GLFWwindow* lWindow, unsigned int key)
 		break;
 	case 't':
 	{
-		if (!texture.empty())
+		if (!texture.Empty())
 			isTextured = !isTextured;
+		else
+			changed = false;
 		break;
 	}
 		
@@ -204,13 +321,76 @@ void CharacterCallback(GLFWwindow* lWindow, unsigned int key)
 		glBindTexture(GL_TEXTURE_2D, 0);
 		textureMode = 2;
 		break;
+	case 'b':
+		// Back-face culling of the CPU renderer, for closed meshes
+		tileRenderer.SetBackFaceCulling(!tileRenderer.BackFaceCulling());
+		if (tileRenderer.BackFaceCulling()) { std::cout << "Back-face culling on\n"; }
+		else { std::cout << "Back-face culling off\n"; }
+		break;
+	case 'v':
+		// Forward or visibility buffer (deferred) shading on the CPU
+		tileRenderer.SetDeferred(!tileRenderer.Deferred());
+		if (tileRenderer.Deferred()) { std::cout << "Deferred CPU shading\n"; }
+		else { std::cout << "Forward CPU shading\n"; }
+		break;
+	case 'o':
+		// Front-to-back or mesh draw order on the CPU
+		tileRenderer.SetDepthSort(!tileRenderer.DepthSort());
+		if (tileRenderer.DepthSort()) { std::cout << "Front-to-back CPU draw order\n"; }
+		else { std::cout << "Mesh CPU draw order\n"; }
+		break;
+	case 'f':
+		// Frame format of the CPU renderer
+		colorFormat = colorFormat == COLOR_RGBA8 ? COLOR_RGB_FLOAT : COLOR_RGBA8;
+		if (colorFormat == COLOR_RGBA8) { std::cout << "RGBA8 CPU frame\n"; }
+		else { std::cout << "RGB float CPU frame\n"; }
+		break;
+	case '4':
+		// Offline 4K frame
+		RenderOffline(3840, 2160);
+		changed = false;
+		break;
+	case '8':
+		// Offline 8K frame
+		RenderOffline(7680, 4320);
+		changed = false;
+		break;
+	case 'x':
+		// 4x multisample anti-aliasing on the CPU
+		tileRenderer.SetMultisample(!tileRenderer.Multisample());
+		if (tileRenderer.Multisample()) { std::cout << "CPU 4x MSAA on\n"; }
+		else { std::cout << "CPU 4x MSAA off\n"; }
+		break;
+	case 'r':
+		// Temporal reprojection of the last frame on the CPU
+		tileRenderer.SetReprojection(!tileRenderer.Reprojection());
+		if (tileRenderer.Reprojection()) { std::cout << "CPU reprojection on\n"; }
+		else { std::cout << "CPU reprojection off\n"; }
+		break;
+	case 'g':
+		// Dynamic resolution of the CPU frame
+		dynamicResolution = !dynamicResolution;
+		resolutionScaler.Reset();
+		if (dynamicResolution) { std::cout << "CPU dynamic resolution on, " << resolutionScaler.Target() << " ms\n"; }
+		else { std::cout << "CPU dynamic resolution off\n"; }
+		break;
+	case '[':
+	case ']':
+		// Frame time target of dynamic resolution
+		resolutionScaler.SetTarget(std::max(FRAME_BUDGET_STEP, resolutionScaler.Target() + (key == ']' ? FRAME_BUDGET_STEP : -FRAME_BUDGET_STEP)));
+		std::cout << "CPU frame budget " << resolutionScaler.Target() << " ms\n";
+		changed = dynamicResolution;
+		break;
 	case 'q':
 		glfwSetWindowShouldClose(window, GLFW_TRUE);
+		changed = false;
 		break;
 	default:
+		changed = false;
 		break;
 	}
-
+	if (changed)
+		frameDirty = true;
 
 }
 
@@ -229,6 +409,7 @@ void CreateTriangleVector(std::vector<glm::vec3> &vertices, std::vector<glm::vec
 
 		triangleVector.push_back(myTriangle);
 	}
+	tileRenderer.InvalidateMesh();
 }
 
 // Load the geometry and texture coordinates if available
@@ -288,29 +469,19 @@ void LoadTexture(char* name)
 		std::cerr << texName << " must have 3 channels (RGB)" << std::endl;
 	else if ((texWidth % 2) != 0 || (texHeight % 2) != 0)
 		std::cerr << " must be a power of 2" << std::endl;
+	else if (!texture.Allocate(texWidth, texHeight))
+		std::cerr << texName << " is too large to mipmap" << std::endl;
 	else
-		texture.push_back(image);
-
-	int length = std::min(texWidth, texHeight);
-	int numLevels = log2(length);
-	
-	float** downImages = new float* [numLevels];
-	for (int i = 0; i < numLevels; i++)
-		downImages[i] = new float[texWidth * texHeight * c];
-
-	for (int i = 0; i < numLevels; i++)
 	{
-		int curWidth = texWidth / pow(2, i + 1);
-		int curHeight = texHeight / pow(2, i + 1);
-		float* temp = new float[curWidth * curHeight * c];
-		stbir_resize_float(image, texWidth, texHeight, 0, temp, curWidth, curHeight, 0, c);
-		stbir_resize_float(temp, texWidth / pow(2, i + 1), texHeight / pow(2, i + 1), 0, downImages[i], texWidth, texHeight, 0, c);
-		texture.push_back(downImages[i]);
-		stbi_image_free(temp);
+		// Level 0 is the image itself; every other level is reduced from the one before it
+		std::copy(image, image + (size_t)texWidth * texHeight * c, texture.Level(0));
+		texture.Generate(tileRenderer.Pool());
 	}
 
+	if (image)
+		stbi_image_free(image);
 
-	if (!texture.empty())
+	if (!texture.Empty())
 	{
 		glGenTextures(1, &texID);
 		glBindTexture(GL_TEXTURE_2D, texID);
@@ -318,7 +489,7 @@ void LoadTexture(char* name)
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texWidth, texHeight, 0, GL_RGB, GL_FLOAT, texture[0]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texWidth, texHeight, 0, GL_RGB, GL_FLOAT, texture.Level(0));
 		glGenerateMipmap(GL_TEXTURE_2D);
 		glBindTexture(GL_TEXTURE_2D, 0);
 	}
@@ -332,6 +503,8 @@ std::string WindowTitle(std::string mainName)
 		hardwareName = " - GPU";
 	else
 		hardwareName = " - CPU";
+	if (!isOpenGL && reducedFrame)
+		hardwareName += " " + std::to_string((int)(resolutionScaler.Scale() * 100.0f + 0.5f)) + "%";
 
 	std::string textureMethod;
 	if (textureMode == 0)
@@ -359,17 +532,22 @@ void Init()
 {
 	srand(time(NULL));
 	glfwInit();
-	glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+	glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 	window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WindowTitle(mainName).c_str(), NULL, NULL);
 	glfwMakeContextCurrent(window);
 	glfwSetCharCallback(window, CharacterCallback);
+	glfwSetFramebufferSizeCallback(window, FramebufferSizeCallback);
+	glfwSetWindowRefreshCallback(window, WindowRefreshCallback);
 	glewExperimental = GL_TRUE;
 	glewInit();
-	glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+	glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
+	glViewport(0, 0, windowWidth, windowHeight);
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glEnable(GL_DEPTH_TEST);
 
-	ClearFrameBuffer();
+	framePresenter = new FramePresenter();
+	std::cout << "CPU rasterizer: " << tileRenderer.SpanName() << std::endl;
+	std::cout << "CPU frames: " << (framePresenter->Persistent() ? "persistently mapped pixel buffers" : "glDrawPixels") << std::endl;
 
 	std::string modelName;
 	std::cout << "Input model file name: ";
@@ -382,7 +560,7 @@ void Init()
 	if (!texCoords.empty())
 	{
 		LoadTexture("../resources/earth.jpg");
-		if (texture.empty())
+		if (texture.Empty())
 			isTextured = false;
 	}
 	else
@@ -399,13 +577,42 @@ int main()
 	Init();
 	while ( glfwWindowShouldClose(window) == 0) 
 	{
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		Display();
-		glfwSwapBuffers(window);
-		glfwPollEvents();
-		glfwSetWindowTitle(window, WindowTitle(mainName).c_str());
+		// Frames are only rendered when something changed; otherwise the loop sleeps until the next event
+		if (frameDirty)
+		{
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			Display();
+			glfwSwapBuffers(window);
+			glfwSetWindowTitle(window, WindowTitle(mainName).c_str());
+			frameDirty = false;
+			redrawPending = false;
+			frameTime = glfwGetTime();
+		}
+		else if (redrawPending)
+		{
+			// The CPU frame is shown again from the presenter; only the GPU path draws the scene again
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			if (isOpenGL || !framePresenter->Redraw(windowWidth, windowHeight))
+				Display();
+			glfwSwapBuffers(window);
+			redrawPending = false;
+		}
+		else if (!isOpenGL && reducedFrame && glfwGetTime() - frameTime >= SETTLE_TIME)
+		{
+			// Nothing changed for a while: the reduced frame is rendered again at window size
+			fullResolution = true;
+			frameDirty = true;
+			continue;
+		}
+
+		// A reduced frame on screen needs a timeout, so it is replaced even if no event comes
+		if (!isOpenGL && reducedFrame)
+			glfwWaitEventsTimeout(SETTLE_TIME);
+		else
+			glfwWaitEvents();
 	}
 
+	delete framePresenter;
 	glfwTerminate();
 	return 0;
 }
\ No newline at end of file